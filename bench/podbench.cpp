@@ -0,0 +1,136 @@
+/* Throughput benchmark for the C++ POD parser.
+ *
+ * Copyright © 2019 Marvin Gülker
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Usage: podbench [-n ITERATIONS] FILE...
+ *
+ * Parses and renders each FILE ITERATIONS times and prints the
+ * throughput of both steps, and of PodParser::Scan() alone. This
+ * program is also the training run of the profile-guided build (see
+ * "make pgo"), so it should keep exercising the same code paths a
+ * real documentation build does. */
+
+#include "../pod.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace Pod;
+
+static std::string filename_cb(std::string classmodname)
+{
+    return classmodname + ".html";
+}
+
+static std::string methodname_cb(bool cmethod, std::string methodname)
+{
+    return cmethod ? methodname + "-cm" : methodname + "-im";
+}
+
+static bool read_file(const char* path, std::string& content)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+        return false;
+
+    std::stringstream ss;
+    ss << file.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    typedef std::chrono::steady_clock clock;
+
+    int iterations = 10;
+    int first_file = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first_file = 3;
+    }
+    if (first_file >= argc || iterations <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [-n ITERATIONS] FILE..." << std::endl;
+        return 1;
+    }
+
+    size_t total_bytes = 0;
+    size_t total_output = 0;
+    clock::duration parse_time(0);
+    clock::duration render_time(0);
+    clock::duration scan_time(0);
+    PodParser scanner(std::string(), filename_cb, methodname_cb);
+
+    for (int i=first_file; i < argc; i++) {
+        std::string source;
+        if (!read_file(argv[i], source)) {
+            std::cerr << "Cannot read '" << argv[i] << "'" << std::endl;
+            return 1;
+        }
+
+        for (int n=0; n < iterations; n++) {
+            clock::time_point start = clock::now();
+            PodParser parser(source, filename_cb, methodname_cb);
+            parser.Parse();
+            clock::time_point parsed = clock::now();
+            std::string html = FormatHTML(parser.GetTokenStream());
+            clock::time_point rendered = clock::now();
+
+            parse_time  += parsed - start;
+            render_time += rendered - parsed;
+            total_output += html.length();
+        }
+
+        for (int n=0; n < iterations; n++) {
+            clock::time_point start = clock::now();
+            scanner.Reset(source);
+            scanner.Scan();
+            scan_time += clock::now() - start;
+        }
+        total_bytes += source.length() * iterations;
+    }
+
+    double parse_s  = std::chrono::duration<double>(parse_time).count();
+    double render_s = std::chrono::duration<double>(render_time).count();
+    double scan_s   = std::chrono::duration<double>(scan_time).count();
+    double mbytes   = total_bytes / (1024.0 * 1024.0);
+
+    printf("input:  %10.2f MiB in %d file(s), %d iteration(s)\n", mbytes, argc - first_file, iterations);
+    printf("output: %10.2f MiB\n", total_output / (1024.0 * 1024.0));
+    printf("parse:  %10.3f s  %10.2f MiB/s\n", parse_s, mbytes / parse_s);
+    printf("render: %10.3f s  %10.2f MiB/s\n", render_s, mbytes / render_s);
+    printf("total:  %10.3f s  %10.2f MiB/s\n", parse_s + render_s, mbytes / (parse_s + render_s));
+    printf("scan:   %10.3f s  %10.2f MiB/s\n", scan_s, mbytes / scan_s);
+
+    return 0;
+}
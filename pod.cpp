@@ -30,13 +30,39 @@
 
 #include "pod.hpp"
 #include <sstream>
-#include <iostream>
+#include <stdexcept>
 #include <iterator>
 #include <algorithm>
-#include <stack>
+#include <queue>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <exception>
+#include <thread>
+#include <sys/uio.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#define POD_SIMD_X86 1
+#include <immintrin.h>
+#endif
 
 using namespace Pod;
 
+// Default for PodParser::SetRetainedCapacity()
+static const size_t s_retained_capacity = 1024 * 1024;
+
+// Empties `container'. Its memory is kept for reuse, unless more
+// than `limit' bytes of it are allocated.
+template<typename Container>
+static void clear_retaining(Container& container, size_t limit)
+{
+    if (container.capacity() * sizeof(typename Container::value_type) > limit)
+        Container().swap(container);
+    else
+        container.clear();
+}
+
 /**
  * Creates a new parser for the POD format. `str' is the string to
  * parse. `fcb' is a function pointer pointing to a callback function
@@ -61,11 +87,28 @@ PodParser::PodParser(const std::string& str,
     : m_lino(0),
       m_mode(mode::none),
       m_link_bar_found(false),
-      m_source_markup(str),
       m_filename_cb(fcb),
       m_mname_cb(mcb),
-      m_verbatim_lead_space(0)
+      m_verbatim_lead_space(0),
+      m_sections_indexed(false),
+      m_lazy_inline(false),
+      m_scratch_parse(false),
+      m_scanning(false),
+      m_retained_capacity(s_retained_capacity),
+      m_line_offset(0),
+      m_para_lino(0),
+      m_diag_cb(nullptr),
+      m_diag_userdata(nullptr),
+      m_diag_min_severity(DiagnosticSeverity::info),
+      m_diag_limit(100),
+      m_diag_suppressed(0)
 {
+    m_stream.m_source = str;
+    m_stream.m_filename_cb = fcb;
+    m_stream.m_mname_cb = mcb;
+    m_scratch_stream.m_filename_cb = fcb;
+    m_scratch_stream.m_mname_cb = mcb;
+    std::fill(std::begin(m_open_markup), std::end(m_open_markup), 0);
 }
 
 PodParser::~PodParser()
@@ -75,28 +118,124 @@ PodParser::~PodParser()
     }
 }
 
+const std::vector<PodNode*>& PodParser::GetTokens()
+{
+    ParseInline();
+    for (size_t i=m_tokens.size(); i < m_stream.Size(); i++) {
+        m_tokens.push_back(m_stream.MakeNode(i));
+    }
+
+    return m_tokens;
+}
+
 /**
  * Clear internal state and remap the parser to point to `str'.
  * Calling Parse() subsequently will parse `str' instead of what was
- * passed to the constructor.
+ * passed to the constructor. The PodNode instances returned by
+ * GetTokens() are freed, because they may refer to the old source.
+ *
+ * The memory of the token stream and of the parser's buffers is
+ * kept for the next document, up to the limit set with
+ * SetRetainedCapacity(). Reusing a parser this way, e.g. one per
+ * thread, saves most of the allocations of parsing a document.
  */
 void PodParser::Reset(const std::string& str)
 {
-    m_source_markup = str;
     m_lino = 0;
-    m_tokens.clear();
+    m_mode = mode::none;
+    for (PodNode* p_node: m_tokens) {
+        delete p_node;
+    }
+    clear_retaining(m_tokens, m_retained_capacity);
+    m_stream.clear(m_retained_capacity);
+    m_stream.m_source = str;
+    std::fill(std::begin(m_open_markup), std::end(m_open_markup), 0);
+    clear_retaining(m_current_buffer, m_retained_capacity);
+    clear_retaining(m_para_line_offsets, m_retained_capacity);
+    clear_retaining(m_para_source_offsets, m_retained_capacity);
+    clear_retaining(m_inline_buffer, m_retained_capacity);
+    clear_retaining(m_inline_text, m_retained_capacity);
+    clear_retaining(m_inline_stack, m_retained_capacity);
+    clear_retaining(m_inline_bits, m_retained_capacity);
+    m_arguments.clear();
     m_idx_keywords.clear();
+    m_heading_anchors.clear();
+    m_anchors.clear();
+    clear_retaining(m_outline, m_retained_capacity);
+    clear_retaining(m_links, m_retained_capacity);
+    clear_retaining(m_sections, m_retained_capacity);
+    clear_retaining(m_blocks, m_retained_capacity);
+    m_heading_sections.clear();
+    m_item_sections.clear();
+    m_sections_indexed = false;
+    clear_retaining(m_diagnostics, m_retained_capacity);
+    m_diag_counts.clear();
+    m_diag_suppressed = 0;
+    m_last_diagnostic = PodDiagnostic();
+    m_pending.clear();
+    m_scratch_stream.clear(m_retained_capacity);
+    clear_retaining(m_scan_source, m_retained_capacity);
+}
+
+/**
+ * Limit the memory Reset() keeps to `bytes' per buffer; larger
+ * buffers, which only a large document needs, are freed. Defaults
+ * to 1 MiB.
+ */
+void PodParser::SetRetainedCapacity(size_t bytes)
+{
+    m_retained_capacity = bytes;
+}
+
+/**
+ * Route diagnostics to `cb' instead of collecting them in the vector
+ * returned by GetDiagnostics(). `p_userdata' is passed through to the
+ * callback unchanged, which allows e.g. a per-thread sink. Pass
+ * nullptr to return to collecting.
+ */
+void PodParser::SetDiagnosticCallback(void (*cb)(const PodDiagnostic&, void*), void* p_userdata)
+{
+    m_diag_cb = cb;
+    m_diag_userdata = p_userdata;
+}
+
+/// Drop all diagnostics less severe than `severity' before their
+/// message is even formatted. Defaults to DiagnosticSeverity::info.
+void PodParser::SetMinimumSeverity(DiagnosticSeverity severity)
+{
+    m_diag_min_severity = severity;
+}
+
+/**
+ * Report at most `limit' diagnostics per DiagnosticCode and Parse()
+ * run; further ones are only counted (see GetSuppressedDiagnosticsCount()).
+ * 0 means no limit. Defaults to 100.
+ */
+void PodParser::SetDiagnosticLimit(unsigned int limit)
+{
+    m_diag_limit = limit;
+}
+
+/**
+ * In lazy mode, Parse() splits the document into its paragraphs as
+ * usual, but leaves the inline markup of ordinary paragraphs for
+ * later: the token stream only holds their para_start and para_end
+ * tokens. Headings and =item lines are parsed as before, so the
+ * outline and lists are complete. ParseInline() then parses all of
+ * the paragraphs, ParseParagraph() a single one. Defaults to false.
+ */
+void PodParser::SetLazyInline(bool lazy)
+{
+    m_lazy_inline = lazy;
 }
 
 /// Start the actual parsing operation (expensive, blocks).
 void PodParser::Parse()
 {
-    if (m_source_markup.empty())
+    const std::string& source = m_stream.m_source;
+    if (source.empty())
         return;
 
-    std::stringstream ss(m_source_markup);
-    std::string line;
-
     m_mode = mode::none;
     m_link_bar_found = false;
     m_verbatim_lead_space = 0;
@@ -104,137 +243,455 @@ void PodParser::Parse()
     m_data_end_tag.clear();
     m_ecode.clear();
     m_idx_kw.clear();
+    m_para_lino = 0;
+    m_para_line_offsets.clear();
+    m_para_source_offsets.clear();
+    m_diag_counts.clear();
+    m_diag_suppressed = 0;
+    m_last_diagnostic = PodDiagnostic();
+    m_diagnostics.clear();
+    m_pending.clear();
+
+    size_t start = 0;
+    while (start < source.length()) {
+        size_t end = source.find('\n', start);
+        if (end == std::string::npos)
+            end = source.length();
 
-    while (std::getline(ss, line)) {
         m_lino++;
-        parse_line(line); // Note: `line' lacks terminal \n
+        m_line_offset = start;
+        parse_line(PodStringRef(source.data() + start, end - start)); // Note: `line' lacks terminal \n
+        start = end + 1;
+
+        // A data region is not split into lines at all
+        if (m_mode == mode::data && start < source.length())
+            start = parse_data(start);
     }
 
     // Terminate whatever is the last element. The empty string
     // is detected by all modes as a terminator.
-    parse_line("");
+    m_line_offset = source.length();
+    parse_line(PodStringRef());
+
+    // A =begin at the end of the document begins an empty data
+    // region, which is unterminated, too.
+    if (m_mode == mode::data)
+        parse_data(source.length());
+
+    if (m_pending.empty())
+        resolve_section_links(); // Otherwise done by ParseInline()
+    m_sections_indexed = false;
+}
+
+/**
+ * Parses the inline markup of the paragraphs Parse() left for later
+ * in lazy mode (see SetLazyInline()), so that the token stream is
+ * complete. This moves the tokens after each paragraph; the outline
+ * is updated accordingly. Diagnostics of the paragraphs are issued
+ * now. GetDiagnostics() then lists them in document order, as after
+ * an eager parse, and SetDiagnosticLimit() applies in that order; a
+ * diagnostic callback gets them after those of Parse(), though.
+ * Does nothing if there are no such paragraphs.
+ */
+void PodParser::ParseInline()
+{
+    if (m_pending.empty())
+        return;
+
+    // The tokens are copied to a new stream, with the tokens of the
+    // paragraphs parsed in between.
+    PodTokenStream blocks;
+    std::swap(blocks, m_stream);
+    m_stream.m_source = std::move(blocks.m_source);
+    m_stream.m_filename_cb = blocks.m_filename_cb;
+    m_stream.m_mname_cb = blocks.m_mname_cb;
+
+    // Likewise the diagnostics of Parse() with those of the
+    // paragraphs. These are counted on their own, and the limit is
+    // applied to all of them afterwards.
+    std::vector<PodDiagnostic> block_diags;
+    if (!m_diag_cb) {
+        std::swap(block_diags, m_diagnostics);
+        m_diag_counts.clear();
+    }
+    size_t next_diag = 0;
+
+    std::vector<size_t> new_index(blocks.Size());
+    auto paragraph = m_pending.begin();
+    for (size_t i=0; i < blocks.Size(); i++) {
+        new_index[i] = m_stream.add_copy(blocks, i);
+        if (paragraph != m_pending.end() && paragraph->token == i) {
+            if (!m_diag_cb) {
+                m_diagnostics.insert(m_diagnostics.end(), block_diags.begin() + next_diag, block_diags.begin() + paragraph->diagnostics);
+                next_diag = paragraph->diagnostics;
+            }
+            load_pending(*paragraph);
+            parse_inline(m_current_buffer, 0);
+            clear_buffer();
+            paragraph++;
+        }
+    }
+    m_pending.clear();
+
+    if (!m_diag_cb) {
+        m_diagnostics.insert(m_diagnostics.end(), block_diags.begin() + next_diag, block_diags.end());
+        limit_diagnostics();
+    }
+
+    for (PodHeading& heading: m_outline) {
+        heading.first_token = new_index[heading.first_token];
+        heading.last_token = new_index[heading.last_token];
+    }
+
+    // The links of the headings came first
+    std::stable_sort(m_links.begin(), m_links.end(), [](const PodLink& a, const PodLink& b) {
+        return a.line < b.line || (a.line == b.line && a.column < b.column);
+    });
+    resolve_section_links();
+    m_sections_indexed = false;
+}
+
+// Drops the diagnostics in m_diagnostics beyond the limit for their
+// DiagnosticCode, counting them as suppressed.
+void PodParser::limit_diagnostics()
+{
+    m_diag_counts.clear();
+    if (m_diag_limit == 0)
+        return;
+
+    size_t kept = 0;
+    for (size_t i=0; i < m_diagnostics.size(); i++) {
+        unsigned int& count = m_diag_counts[m_diagnostics[i].code];
+        if (count >= m_diag_limit) {
+            m_diag_suppressed++;
+            continue;
+        }
+        count++;
+        if (kept != i)
+            m_diagnostics[kept] = std::move(m_diagnostics[i]);
+        kept++;
+    }
+    m_diagnostics.resize(kept);
+}
+
+bool PodParser::IsPending(size_t token) const
+{
+    return find_pending(token) != m_pending.end();
+}
+
+/**
+ * Parses the paragraph Parse() left for later in lazy mode whose
+ * para_start token is `token' (see IsPending()), and returns its
+ * tokens. They are valid until the next call. Unlike ParseInline(),
+ * this leaves the token stream as it is, and no diagnostics, links or
+ * index entries are recorded. Throws std::out_of_range if `token' is
+ * not such a paragraph.
+ */
+const PodTokenStream& PodParser::ParseParagraph(size_t token)
+{
+    auto paragraph = find_pending(token);
+    if (paragraph == m_pending.end())
+        throw(std::out_of_range("Token is not a pending paragraph"));
+
+    load_pending(*paragraph);
+
+    // Parsed on its own, without formatting codes left open before
+    long open_markup[static_cast<int>(mtype::link) + 1];
+    std::copy(std::begin(m_open_markup), std::end(m_open_markup), open_markup);
+    std::fill(std::begin(m_open_markup), std::end(m_open_markup), 0);
+    bool link_bar_found = m_link_bar_found;
+    m_link_bar_found = false;
+
+    m_scratch_stream.clear(m_retained_capacity);
+    std::swap(m_stream, m_scratch_stream);
+    m_scratch_parse = true;
+    parse_inline(m_current_buffer, 0);
+    m_scratch_parse = false;
+    std::swap(m_stream, m_scratch_stream);
+
+    // The headings are all known already
+    for (size_t i=0; i < m_scratch_stream.Size(); i++)
+        resolve_section_link(m_scratch_stream, i);
+
+    std::copy(std::begin(open_markup), std::end(open_markup), m_open_markup);
+    m_link_bar_found = link_bar_found;
+    m_ecode.clear();
+    m_idx_kw.clear();
+    m_link_content.clear();
+    clear_buffer();
+    return m_scratch_stream;
+}
+
+std::vector<PodParser::pending_paragraph>::const_iterator PodParser::find_pending(size_t token) const
+{
+    auto iter = std::lower_bound(m_pending.begin(), m_pending.end(), token,
+                                 [](const pending_paragraph& paragraph, size_t t) { return paragraph.token < t; });
+    return iter != m_pending.end() && iter->token == token ? iter : m_pending.end();
+}
+
+// Buffers pending paragraph `paragraph' again, as parse_line() did.
+void PodParser::load_pending(const pending_paragraph& paragraph)
+{
+    const std::string& source = m_stream.m_source;
+    clear_buffer();
+    m_para_lino = paragraph.line;
+
+    // Each line is followed by its newline, or the end of the source
+    size_t pos = paragraph.source_offset;
+    size_t end = paragraph.source_offset + paragraph.length;
+    while (pos < end) {
+        size_t eol = std::min(source.find('\n', pos), end - 1);
+        m_line_offset = pos;
+        buffer_line(PodStringRef(source.data() + pos, eol - pos), ' ');
+        pos = eol + 1;
+    }
+}
+
+// Splits `str' from `start' on into the words separated by white
+// space. The strings already in `words' are reused.
+static void split_words(const std::string& str, size_t start, std::vector<std::string>& words)
+{
+    static const char whitespace[] = " \t\n\v\f\r";
+    size_t count = 0;
+    size_t pos = str.find_first_not_of(whitespace, start);
+    while (pos != std::string::npos) {
+        size_t end = std::min(str.find_first_of(whitespace, pos), str.length());
+        if (count == words.size())
+            words.emplace_back();
+        words[count++].assign(str, pos, end - pos);
+        pos = str.find_first_not_of(whitespace, end);
+    }
+    words.resize(count);
+}
+
+static inline bool equals(PodStringRef ref, const std::string& str)
+{
+    return ref.Size() == str.length() && memcmp(ref.Data(), str.data(), str.length()) == 0;
+}
+
+// Whether `line' starts a command paragraph, i.e. begins with "="
+// followed by an identifier.
+static inline bool is_command_line(const char* p_line, const char* p_end)
+{
+    return p_end - p_line >= 2 && p_line[0] == '=' && isalpha(static_cast<unsigned char>(p_line[1]));
+}
+
+static inline bool is_command_line(PodStringRef line)
+{
+    return is_command_line(line.Data(), line.Data() + line.Size());
+}
+
+// Searches the line "=end `identifier'" from the newline at `p' on;
+// there may be spaces and tabs around the identifier. Returns the
+// start of that line and sets `p_next' to the start of the line after
+// it, or returns `p_end' if there is none.
+static const char* find_end_line(const char* p, const char* p_end, const std::string& identifier, const char*& p_next)
+{
+    while (const char* p_found = static_cast<const char*>(memmem(p, p_end - p, "\n=end", 5))) {
+        const char* p_arg = p_found + 5;
+        const char* p_id = p_arg;
+        while (p_id < p_end && (*p_id == ' ' || *p_id == '\t'))
+            p_id++;
+        if (p_id > p_arg && static_cast<size_t>(p_end - p_id) >= identifier.length()
+            && memcmp(p_id, identifier.data(), identifier.length()) == 0) {
+            const char* p_after = p_id + identifier.length();
+            while (p_after < p_end && (*p_after == ' ' || *p_after == '\t'))
+                p_after++;
+            if (p_after == p_end || *p_after == '\n') {
+                p_next = p_after == p_end ? p_end : p_after + 1;
+                return p_found + 1;
+            }
+        }
+        p = p_found + 1;
+    }
+    p_next = p_end;
+    return p_end;
+}
+
+// Returns the text of the text tokens in [first, last) of `stream' as it was
+// before it was HTML-escaped, without surrounding white space.
+static std::string plain_text(const PodTokenStream& stream, size_t first, size_t last)
+{
+    static const struct {
+        const char* escaped;
+        size_t length;
+        char ch;
+    } escapes[] = {{"&amp;", 5, '&'}, {"&lt;", 4, '<'}, {"&gt;", 4, '>'}, {"&nbsp;", 6, ' '}};
+
+    std::string result;
+    for (size_t i=first; i < last; i++) {
+        if (stream.GetNtype(i) != ntype::text)
+            continue;
+
+        PodStringRef text = stream.GetPayload(i);
+        for (size_t pos=0; pos < text.Size(); pos++) {
+            char ch = text[pos];
+            if (ch == '&') {
+                for (const auto& escape: escapes) {
+                    if (text.Size() - pos >= escape.length && memcmp(text.Data() + pos, escape.escaped, escape.length) == 0) {
+                        ch = escape.ch;
+                        pos += escape.length - 1;
+                        break;
+                    }
+                }
+            }
+            result += ch;
+        }
+    }
+
+    size_t start = result.find_first_not_of(' ');
+    if (start == std::string::npos)
+        return std::string();
+    return result.substr(start, result.find_last_not_of(' ') - start + 1);
 }
 
-void PodParser::parse_line(const std::string& line)
+void PodParser::parse_line(PodStringRef line)
 {
     switch(m_mode) {
     case mode::command:
-        if (line.empty()) { // Empty line terminates command paragraph
+        if (line.Empty()) { // Empty line terminates command paragraph
+            m_mode = mode::none; // Unless the command sets another mode
             parse_command(m_current_buffer);
-
-            m_mode = mode::none;
-            m_current_buffer.clear();
+            clear_buffer();
         }
         else {
-            m_current_buffer += line + " "; // Replace end-of-line newline with space
+            buffer_line(line, ' '); // Replace end-of-line newline with space
         }
         break;
     case mode::ordinary:
-        if (line.empty()) { // Empty line terminates ordinary paragraph
+        if (line.Empty()) { // Empty line terminates ordinary paragraph
             parse_ordinary(m_current_buffer);
             m_mode = mode::none;
-            m_current_buffer.clear();
+            clear_buffer();
         }
         else {
-            m_current_buffer += line + " "; // Replace end-of-line newline with space
+            buffer_line(line, ' '); // Replace end-of-line newline with space
         }
         break;
     case mode::verbatim:
-        if (line.empty()) { // Empty line terminates verbatim paragraph
+        if (line.Empty()) { // Empty line terminates verbatim paragraph
             parse_verbatim(m_current_buffer);
 
             m_mode = mode::none;
-            m_current_buffer.clear();
+            clear_buffer();
             // Note: do not reset m_verbatim_lead_space here, it's required for a possible adjascent verbatim paragraph.
         }
         else {
-            m_current_buffer += line + "\n"; // Re-add newline at end of line
+            buffer_line(line, '\n'); // Re-add newline at end of line
         }
         break;
     case mode::data:
-        // Note: "data" mode can only be activated in parse_command()
-        if (line == m_data_end_tag) { // "=end <identifier>" ends data mode
-            parse_data(m_current_buffer);
-            m_mode = mode::none;
-            m_current_buffer.clear();
-            m_data_end_tag.clear();
-            m_data_args.clear();
-        }
-        else {
-            m_current_buffer += line + "\n"; // Re-add newline at end of line
-        }
+        // Note: "data" mode can only be activated in parse_command(),
+        // and its lines are consumed by parse_data() instead. This is
+        // only reached if the source ends right after the =begin.
         break;
     case mode::cut:
         // Note: "cut" mode can only be activated in parse_command()
-        // Note2: While in "cut" mode everything other than "=pod" is ignored.
-        if (line == "=pod") // =pod ends cut mode
-            m_mode = mode::none;
-        break;
+        // Note2: "cut" mode ends at the next command paragraph of
+        // any kind, which is then handled as usual; everything
+        // before it is ignored.
+        if (!is_command_line(line))
+            break;
+        m_mode = mode::none;
+        // fall-through
     default: // No consumer mode active, check what's requested now (m_mode == mode::none)
-        switch (line[0]) {
+        m_para_lino = m_lino;
+        clear_buffer();
+
+        switch (line.Empty() ? '\0' : line[0]) {
         case '\0': // Empty line, ignore
             break;
         case '=': // Command encountered
-            m_current_buffer = line + " "; // Replace end-of-line newline with space
+            buffer_line(line, ' '); // Replace end-of-line newline with space
             m_mode = mode::command;
             break;
         case ' ':  // fall-through
         case '\t': // Verbatim encountered
             // Note: Subsequent lines of verbatim don't have to be indented!
             m_verbatim_lead_space = count_leading_whitespace(line); // For stripping leading spaces later on
-            m_current_buffer = line + "\n"; // Re-add missing end-of-line
+            buffer_line(line, '\n'); // Re-add missing end-of-line
             m_mode = mode::verbatim;
             break;
         default: // Ordinary paragraph encountered
             m_mode = mode::ordinary;
-            m_current_buffer = line + " "; // Replace end-of-line with space
+            buffer_line(line, ' '); // Replace end-of-line with space
             break;
         }
         break;
     }
 }
 
+// Appends `line' to m_current_buffer, terminated by `eol', and
+// records where it came from.
+void PodParser::buffer_line(PodStringRef line, char eol)
+{
+    m_para_line_offsets.push_back(m_current_buffer.length());
+    m_para_source_offsets.push_back(m_line_offset);
+    m_current_buffer.append(line.Data(), line.Size());
+    m_current_buffer += eol;
+}
+
+void PodParser::clear_buffer()
+{
+    m_current_buffer.clear();
+    m_para_line_offsets.clear();
+    m_para_source_offsets.clear();
+}
+
+// Maps position `bufpos' in m_current_buffer to the position in the
+// source it was copied from. The newline replaced by the end-of-line
+// space maps to the source's newline.
+size_t PodParser::source_offset(size_t bufpos)
+{
+    auto iter = std::upper_bound(m_para_line_offsets.begin(), m_para_line_offsets.end(), bufpos) - 1;
+    return m_para_source_offsets[iter - m_para_line_offsets.begin()] + (bufpos - *iter);
+}
+
 // Note: `ordinary' is already cleared from newlines.
-void PodParser::parse_ordinary(std::string ordinary)
+void PodParser::parse_ordinary(const std::string& ordinary)
 {
-    m_tokens.push_back(new PodNodeParaStart());
-    parse_inline(ordinary);
-    m_tokens.push_back(new PodNodeParaEnd());
+    size_t token = m_stream.add(ntype::para_start, 0);
+    if (m_lazy_inline)
+        m_pending.push_back(pending_paragraph{token, m_para_source_offsets[0], ordinary.length(), m_para_lino, m_diagnostics.size()});
+    else
+        parse_inline(ordinary, 0);
+    m_stream.add(ntype::para_end, 0);
 }
 
 // Note: `command' is already cleared from newlines.
-void PodParser::parse_command(std::string command)
+void PodParser::parse_command(const std::string& command)
 {
-    // Parse command line into command and arguments using
-    // nasty magic because C++ has no "split string" function
-    // <https://stackoverflow.com/a/237280>
-    std::istringstream iss(command.substr(1)); // 1 for skipping the leading "="
-    std::vector<std::string> arguments{std::istream_iterator<std::string>{iss},
-            std::istream_iterator<std::string>{}};
+    // Split the command line into command and arguments
+    std::vector<std::string>& arguments = m_arguments;
+    split_words(command, 1, arguments); // 1 for skipping the leading "="
+
+    if (arguments.empty()) {
+        if (diagnostic_wanted(DiagnosticCode::invalid_command))
+            diagnose(DiagnosticCode::invalid_command, 0, "Ignoring '=' without command name");
+        return;
+    }
 
     std::string cmd = arguments[0];
     arguments.erase(arguments.begin());
 
     // Execute the command
-    if (cmd == "head1") {
-        m_tokens.push_back(new PodNodeHeadStart(1, command.substr(cmd.length()+2)));
-        parse_inline(command.substr(cmd.length()+2));
-        m_tokens.push_back(new PodNodeHeadEnd(1));
-    }
-    else if (cmd == "head2") {
-        m_tokens.push_back(new PodNodeHeadStart(2, command.substr(cmd.length()+2)));
-        parse_inline(command.substr(cmd.length()+2));
-        m_tokens.push_back(new PodNodeHeadEnd(2));
-    }
-    else if (cmd == "head3") {
-        m_tokens.push_back(new PodNodeHeadStart(3, command.substr(cmd.length()+2)));
-        parse_inline(command.substr(cmd.length()+2));
-        m_tokens.push_back(new PodNodeHeadEnd(3));
-    }
-    else if (cmd == "head4") {
-        m_tokens.push_back(new PodNodeHeadStart(4, command.substr(cmd.length()+2)));
-        parse_inline(command.substr(cmd.length()+2));
-        m_tokens.push_back(new PodNodeHeadEnd(4));
+    if (cmd == "head1" || cmd == "head2" || cmd == "head3" || cmd == "head4") {
+        unsigned char level = cmd[4] - '0';
+        PodHeading heading;
+        heading.level = level;
+        heading.first_token = m_stream.add(ntype::head_start, level);
+        m_inline_buffer.assign(command, cmd.length()+2, std::string::npos);
+        parse_inline(m_inline_buffer, cmd.length()+2);
+        heading.text = plain_text(m_stream, heading.first_token + 1, m_stream.Size());
+        heading.anchor = register_anchor(heading.text);
+        m_stream.set_payload(heading.first_token, heading.anchor);
+        heading.last_token = m_stream.add(ntype::head_end, level);
+
+        // The enclosing heading is the last one of lower level
+        heading.parent = m_outline.empty() ? std::string::npos : m_outline.size() - 1;
+        while (heading.parent != std::string::npos && m_outline[heading.parent].level >= level)
+            heading.parent = m_outline[heading.parent].parent;
+        m_outline.push_back(heading);
     }
     else if (cmd == "pod") {
         // This command is a no-op. It is only valid if found after a =cut command,
@@ -244,17 +701,26 @@ void PodParser::parse_command(std::string command)
         m_mode = mode::cut;
     }
     else if (cmd == "over") {
-        if (arguments.empty())
-            m_tokens.push_back(new PodNodeOver());
-        else
-            m_tokens.push_back(new PodNodeOver(std::stof(arguments[0])));
+        // The indent is kept as text, but only if it is valid.
+        std::string indent;
+        if (!arguments.empty()) {
+            try {
+                std::stof(arguments[0]);
+                indent = arguments[0];
+            }
+            catch (std::logic_error&) { // invalid_argument or out_of_range
+                if (diagnostic_wanted(DiagnosticCode::invalid_over_indent))
+                    diagnose(DiagnosticCode::invalid_over_indent, 0, "Invalid =over indentation '" + arguments[0] + "', assuming 4");
+            }
+        }
+        m_stream.add(ntype::over, static_cast<unsigned char>(OverListType::unordered), indent);
     }
     else if (cmd == "item") {
         // If there's a preceeding =item, close it (there's none at the beginning
         // of a =over block).
-        PodNodeItemStart* p_preceeding_item = find_preceeding_item();
-        if (p_preceeding_item)
-            m_tokens.push_back(new PodNodeItemEnd(p_preceeding_item->GetListType()));
+        size_t preceeding_item = find_preceeding_item();
+        if (preceeding_item != std::string::npos)
+            m_stream.add(ntype::item_end, m_stream.GetFlags(preceeding_item));
 
         // If "=item" is not followed by *, 0-9 or [ (including not being
         // followed by anything, i.e. bare), then it's a shorthand
@@ -284,50 +750,57 @@ void PodParser::parse_command(std::string command)
                 dt += " ";
             }
 
-            m_tokens.push_back(new PodNodeItemStart(dt));
+            m_stream.add(ntype::item_start, static_cast<unsigned char>(PodNodeItemStart::ListTypeFromLabel(dt)), dt);
         }
         else { // Not a definition list
-            m_tokens.push_back(new PodNodeItemStart(arguments[0]));
+            m_stream.add(ntype::item_start, static_cast<unsigned char>(PodNodeItemStart::ListTypeFromLabel(arguments[0])), arguments[0]);
             arguments.erase(arguments.begin());
         }
 
         std::string para = join_vectorstr(arguments, " ");
-        m_tokens.push_back(new PodNodeParaStart());
+        m_stream.add(ntype::para_start, 0);
         parse_inline(para);
-        m_tokens.push_back(new PodNodeParaEnd());
+        m_stream.add(ntype::para_end, 0);
     }
     else if (cmd == "back") {
         OverListType list_type = OverListType::unordered;
 
         // If there's a preceeding =item, close it (there's none at the beginning
         // of a =over block).
-        PodNodeItemStart* p_preceeding_item = find_preceeding_item();
-        if (p_preceeding_item) {
-            m_tokens.push_back(new PodNodeItemEnd(p_preceeding_item->GetListType()));
-            list_type = p_preceeding_item->GetListType();
+        size_t preceeding_item = find_preceeding_item();
+        if (preceeding_item != std::string::npos) {
+            list_type = m_stream.GetListType(preceeding_item);
+            m_stream.add(ntype::item_end, static_cast<unsigned char>(list_type));
 
             // Set the list type. The list type is set from the list's
             // last item (only), but since all items need to be of the
             // same time, this should rarely ever be a problem.
-            PodNodeOver* p_preceeding_over = find_preceeding_over();
-            if (p_preceeding_over) {
-                p_preceeding_over->SetListType(list_type);
+            size_t preceeding_over = find_preceeding_over();
+            if (preceeding_over != std::string::npos) {
+                m_stream.m_flags[preceeding_over] = static_cast<unsigned char>(list_type);
             }
         }
-        else {
-            std::cerr << "Warning on line " << m_lino << ": empty =over block" << std::endl;
+        else if (diagnostic_wanted(DiagnosticCode::empty_over)) {
+            diagnose(DiagnosticCode::empty_over, 0, "empty =over block");
         }
 
-        m_tokens.push_back(new PodNodeBack(list_type));
+        m_stream.add(ntype::back, static_cast<unsigned char>(list_type));
     }
     else if (cmd == "begin") {
+        if (arguments.empty()) {
+            if (diagnostic_wanted(DiagnosticCode::invalid_command))
+                diagnose(DiagnosticCode::invalid_command, 0, "=begin command lacks identifier, ignoring");
+            return;
+        }
+
         m_data_end_tag = std::string("=end ") + arguments[0];
         m_data_args = arguments;
         m_mode = mode::data;
-    } // Note: "=end" is checked for in "data" mode in parse_line()
-    else if (cmd == "=for") {
+    } // Note: "=end" is searched for by parse_data()
+    else if (cmd == "for") {
         if (arguments.empty()) {
-            std::cerr << "Warning on line " << m_lino << ": =for command lacks argument, ignoring" << std::endl;
+            if (diagnostic_wanted(DiagnosticCode::for_lacks_argument))
+                diagnose(DiagnosticCode::for_lacks_argument, 0, "=for command lacks argument, ignoring");
             return;
         }
 
@@ -336,66 +809,363 @@ void PodParser::parse_command(std::string command)
         std::string content = join_vectorstr(arguments, " ");
 
         if (formatname[0] == ':') { // Colon means treat as normal paragraph
-            m_tokens.push_back(new PodNodeParaStart());
+            m_stream.add(ntype::para_start, 0);
             parse_inline(content);
-            m_tokens.push_back(new PodNodeParaEnd());
+            m_stream.add(ntype::para_end, 0);
         }
         else { // Shorthand for =begin...=end
+            // The data is the rest of the paragraph as it is in the
+            // source, i.e. including its newlines.
+            size_t pos = command.find_first_not_of(" \t", command.find_first_of(" \t", command.find_first_not_of(" \t", 4)));
+            size_t index;
+            if (pos == std::string::npos)
+                index = m_stream.add(ntype::data, 0);
+            else {
+                size_t srcstart = source_offset(pos);
+                size_t srcend = std::min(source_offset(command.length() - 1) + 1, m_stream.m_source.length());
+                index = m_stream.add_borrowed(ntype::data, 0, srcstart, srcend - srcstart);
+            }
+
             std::vector<std::string> args;
             args.push_back(formatname);
-            m_tokens.push_back(new PodNodeData(content, args));
+            m_stream.add_data_arguments(index, args);
         }
     }
     else if (cmd == "encoding") {
-        std::cerr << "Warning on line " << m_lino << ": the =encoding command is ignored, UTF-8 is assumed." << std::endl;
+        if (diagnostic_wanted(DiagnosticCode::encoding_ignored))
+            diagnose(DiagnosticCode::encoding_ignored, 0, "the =encoding command is ignored, UTF-8 is assumed.");
     }
-    else {
-        std::cerr << "Warning on line " << m_lino << ": Ignoring unknown command '" << cmd << "'" << std::endl;
+    else if (diagnostic_wanted(DiagnosticCode::unknown_command)) {
+        diagnose(DiagnosticCode::unknown_command, 0, "Ignoring unknown command '" + cmd + "'");
     }
 }
 
-void PodParser::parse_verbatim(std::string verbatim)
+void PodParser::parse_verbatim(const std::string& verbatim)
 {
-    // Strip leading white space
-    if (m_verbatim_lead_space > 0) {
-        std::stringstream ss(verbatim);
-        std::string line;
-        verbatim = "";
-        while (std::getline(ss, line)) {
-            verbatim += line.substr(m_verbatim_lead_space) + "\n";
-        }
+    /* The text is an exact copy of the source it starts at. It is
+     * kept including its leading white space, which is stripped
+     * only on output (see append_unindented()); that way the stream
+     * can refer to the source instead of copying it. This needs the
+     * indentation to fit into the token flags. */
+    size_t srcoff = m_para_source_offsets[0];
+    size_t indent = m_verbatim_lead_space;
+    const std::string* p_text = &verbatim;
+    std::string unindented;
+    if (indent >= PodTokenStream::borrowed_flag) {
+        append_unindented(unindented, verbatim, indent);
+        p_text = &unindented;
+        srcoff = std::string::npos;
+        indent = 0;
     }
 
     // Extend the previous verbatim node, if there is any
     // (i.e. join subsequent verbatim lines).
-    PodNodeVerbatim* p_prev_verb = nullptr;
-    if (m_tokens.size() > 0)
-        p_prev_verb = dynamic_cast<PodNodeVerbatim*>(m_tokens.back());
-    if (p_prev_verb) {
-        p_prev_verb->AddText("\n");
-        p_prev_verb->AddText(verbatim);
+    size_t last = m_stream.Size() - 1;
+    if (m_stream.Size() > 0 && m_stream.GetNtype(last) == ntype::verbatim) {
+        if (m_stream.GetFlags(last) != indent) {
+            // Differently indented, so both have to be stripped. The
+            // previous text only once; after that, its indentation
+            // is 0 and only the new text needs stripping.
+            if (m_stream.GetFlags(last) != 0) {
+                m_stream.set_payload(last, m_stream.GetVerbatimText(last));
+                m_stream.m_flags[last] = 0;
+            }
+            if (p_text == &verbatim) {
+                append_unindented(unindented, verbatim, indent);
+                p_text = &unindented;
+                srcoff = std::string::npos;
+            }
+        }
+
+        // The joining newline is the blank line's in the source
+        m_stream.append_payload(last, "\n", srcoff == std::string::npos ? srcoff : srcoff - 1);
+        m_stream.append_payload(last, *p_text, srcoff);
     }
     else
-        m_tokens.push_back(new PodNodeVerbatim(verbatim));
+        m_stream.add(ntype::verbatim, static_cast<unsigned char>(indent), *p_text, srcoff);
+}
+
+/* Adds the data region of a =begin that starts at source offset
+ * `start' and returns the offset of the line after its =end. The
+ * region is not looked at line by line; a single search finds the
+ * =end line, and the token refers to the source. */
+size_t PodParser::parse_data(size_t start)
+{
+    const std::string& source = m_stream.m_source;
+
+    // Search from the newline ending the previous line, so that an
+    // =end right at `start' is found as well.
+    const char* p_next;
+    size_t end = find_end_line(source.data() + start - 1, source.data() + source.length(), m_data_args[0], p_next) - source.data();
+    size_t next = p_next - source.data();
+
+    if (end == source.length() && diagnostic_wanted(DiagnosticCode::unterminated_data))
+        diagnose(DiagnosticCode::unterminated_data, std::string::npos, "Missing '" + m_data_end_tag + "', data runs up to the end of the document");
+
+    // Line numbers go on after the =end line
+    m_lino += std::count(source.begin() + start, source.begin() + next, '\n');
+    if (next == source.length() && source[next - 1] != '\n')
+        m_lino++;
+
+    m_stream.add_data_arguments(m_stream.add_borrowed(ntype::data, 0, start, end - start), m_data_args);
+    m_mode = mode::none;
+    m_data_end_tag.clear();
+    m_data_args.clear();
+    return next;
+}
+
+// Returns the end of the paragraph starting at `p', i.e. the start of
+// the empty line after it, or `p_end'. As in Parse(), only a line
+// without any characters is empty, not one of white space.
+static const char* paragraph_end(const char* p, const char* p_end)
+{
+    while (const char* p_eol = static_cast<const char*>(memchr(p, '\n', p_end - p))) {
+        if (p_eol + 1 == p_end || p_eol[1] == '\n')
+            return p_eol + 1;
+        p = p_eol + 1;
+    }
+    return p_end;
+}
+
+// Returns word `n' of the command paragraph [p, p_end) as
+// parse_command() splits it; word 0 is the command name.
+static PodStringRef command_word(const char* p, const char* p_end, int n)
+{
+    static const char whitespace[] = " \t\n\v\f\r";
+    p++; // Skip the "="
+    for (;;) {
+        while (p < p_end && memchr(whitespace, *p, sizeof(whitespace) - 1))
+            p++;
+        const char* p_word = p;
+        while (p < p_end && !memchr(whitespace, *p, sizeof(whitespace) - 1))
+            p++;
+        if (n-- == 0 || p == p_word)
+            return PodStringRef(p_word, p - p_word);
+    }
+}
+
+// Returns the start of the first command line after the newline at
+// `p', where cut mode ends, or `p_end' if there is none.
+static const char* skip_cut(const char* p, const char* p_end)
+{
+    while (const char* p_found = static_cast<const char*>(memmem(p, p_end - p, "\n=", 2))) {
+        if (is_command_line(p_found + 1, p_end))
+            return p_found + 1;
+        p = p_found + 1;
+    }
+    return p_end;
+}
+
+// Copies the paragraphs of `source' Scan() parses to `extract', each
+// followed by an empty line: the command paragraphs except for data,
+// the first ordinary paragraph after a =head1 mentioning NAME and
+// before the next heading, and the other ordinary paragraphs that
+// contain an X<> code. The other paragraphs, data regions and cut
+// parts are only searched for their end.
+static void extract_structure(const std::string& source, std::string& extract)
+{
+    extract.clear();
+
+    const char* p = source.data();
+    const char* p_end = source.data() + source.length();
+    bool name_section = false; // After a =head1 NAME, before its first ordinary paragraph
+    while (p < p_end) {
+        if (*p == '\n') { // Empty line
+            p++;
+            continue;
+        }
+
+        const char* p_next = paragraph_end(p, p_end);
+        bool copy = false;
+        switch (*p) {
+        case '=': {
+            PodStringRef cmd = command_word(p, p_next, 0);
+            if (equals(cmd, "cut")) {
+                p_next = skip_cut(p_next, p_end);
+            }
+            else if (equals(cmd, "begin")) {
+                PodStringRef format = command_word(p, p_next, 1);
+                if (!format.Empty())
+                    find_end_line(p_next, p_end, format.ToString(), p_next);
+            }
+            else if (!equals(cmd, "for")) {
+                copy = true;
+                if (cmd.Size() == 5 && memcmp(cmd.Data(), "head", 4) == 0 && cmd[4] >= '1' && cmd[4] <= '4')
+                    name_section = cmd[4] == '1' && memmem(p, p_next - p, "NAME", 4);
+            }
+            break; }
+        case ' ':  // fall-through
+        case '\t': // Verbatim
+            break;
+        default:   // Ordinary
+            copy = name_section || memmem(p, p_next - p, "X<", 2);
+            name_section = false;
+            break;
+        }
+
+        if (copy) {
+            extract.append(p, p_next - p);
+            extract.append(p_next[-1] == '\n' ? 1 : 2, '\n');
+        }
+        p = p_next;
+    }
+}
+
+/**
+ * Parses only what makes up the structure of the document, in place
+ * of Parse(): the command paragraphs, the first paragraph of the NAME
+ * section and the ordinary paragraphs containing X<> codes. All other
+ * paragraphs, data regions and cut parts are skipped by searching
+ * for their end, so this takes little more than reading the source.
+ *
+ * Afterwards, GetHeadingAnchors(), GetIndexEntries(), GetItemLabels()
+ * and GetAbstract() give what they give after Parse(), and so does
+ * GetOutline() except for the token indices. But the token stream
+ * only holds the parsed paragraphs, GetLinks() only the links in
+ * them, and there are no diagnostics. Lazy mode is not used. Unlike
+ * in Parse(), formatting codes a skipped paragraph leaves open are not
+ * continued in the paragraphs after it.
+ */
+void PodParser::Scan()
+{
+    extract_structure(m_stream.m_source, m_scan_source);
+    std::swap(m_stream.m_source, m_scan_source);
+
+    bool lazy_inline = m_lazy_inline;
+    m_lazy_inline = false;
+    m_scanning = true;
+    Parse();
+    m_scanning = false;
+    m_lazy_inline = lazy_inline;
+}
+
+/* The structural index of a paragraph for parse_inline(): one bit per
+ * byte, set for "<", ">" and "|", the bytes that may end a run of
+ * plain text. The bits of each 64 bytes are made with a few vector
+ * compares, using AVX-512, AVX2 or SSE2, whichever the CPU has; the
+ * last bytes are looked at one by one. `p_bits' must be zeroed. */
+typedef void (*mark_structural_function)(const char* p_data, size_t length, uint64_t* p_bits);
+
+static void mark_structural_bytewise(const char* p_data, size_t length, uint64_t* p_bits)
+{
+    for (size_t i=0; i < length; i++) {
+        char ch = p_data[i];
+        if (ch == '<' || ch == '>' || ch == '|')
+            p_bits[i / 64] |= uint64_t(1) << (i % 64);
+    }
+}
+
+#ifdef POD_SIMD_X86
+static void mark_structural_sse2(const char* p_data, size_t length, uint64_t* p_bits)
+{
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i bar = _mm_set1_epi8('|');
+
+    size_t blocks = length / 64;
+    for (size_t b=0; b < blocks; b++) {
+        uint64_t bits = 0;
+        for (int k=0; k < 4; k++) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p_data + b*64 + k*16));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, lt), _mm_cmpeq_epi8(chunk, gt)),
+                                        _mm_cmpeq_epi8(chunk, bar));
+            bits |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(hits))) << (k*16);
+        }
+        p_bits[b] = bits;
+    }
+    mark_structural_bytewise(p_data + blocks*64, length % 64, p_bits + blocks);
+}
+
+__attribute__((target("avx2")))
+static void mark_structural_avx2(const char* p_data, size_t length, uint64_t* p_bits)
+{
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i bar = _mm256_set1_epi8('|');
+
+    size_t blocks = length / 64;
+    for (size_t b=0; b < blocks; b++) {
+        uint64_t bits = 0;
+        for (int k=0; k < 2; k++) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p_data + b*64 + k*32));
+            __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, lt), _mm256_cmpeq_epi8(chunk, gt)),
+                                           _mm256_cmpeq_epi8(chunk, bar));
+            bits |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(hits))) << (k*32);
+        }
+        p_bits[b] = bits;
+    }
+    mark_structural_bytewise(p_data + blocks*64, length % 64, p_bits + blocks);
+}
+
+__attribute__((target("avx512bw")))
+static void mark_structural_avx512(const char* p_data, size_t length, uint64_t* p_bits)
+{
+    const __m512i lt = _mm512_set1_epi8('<');
+    const __m512i gt = _mm512_set1_epi8('>');
+    const __m512i bar = _mm512_set1_epi8('|');
+
+    size_t blocks = length / 64;
+    for (size_t b=0; b < blocks; b++) {
+        __m512i chunk = _mm512_loadu_si512(p_data + b*64);
+        p_bits[b] = _mm512_cmpeq_epi8_mask(chunk, lt) | _mm512_cmpeq_epi8_mask(chunk, gt)
+                  | _mm512_cmpeq_epi8_mask(chunk, bar);
+    }
+    mark_structural_bytewise(p_data + blocks*64, length % 64, p_bits + blocks);
 }
+#endif
 
-void PodParser::parse_data(std::string data)
+static mark_structural_function select_mark_structural()
 {
-    m_tokens.push_back(new PodNodeData(data, m_data_args));
+#ifdef POD_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return mark_structural_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return mark_structural_avx2;
+    return mark_structural_sse2;
+#else
+    return mark_structural_bytewise;
+#endif
+}
+
+static void mark_structural(const std::string& para, std::vector<uint64_t>& bits)
+{
+    static const mark_structural_function s_mark = select_mark_structural();
+
+    bits.assign((para.length() + 63) / 64, 0);
+    s_mark(para.data(), para.length(), bits.data());
+}
+
+// Returns the position of the first set bit at or after `pos', or
+// `length' if there is none.
+static size_t next_structural(const std::vector<uint64_t>& bits, size_t pos, size_t length)
+{
+    size_t word = pos / 64;
+    if (word >= bits.size())
+        return length;
+
+    uint64_t rest = bits[word] & (~uint64_t(0) << (pos % 64));
+    while (rest == 0) {
+        if (++word == bits.size())
+            return length;
+        rest = bits[word];
+    }
+    return std::min(word * 64 + __builtin_ctzll(rest), length);
 }
 
 // This function processes `para' as POD inline
 // markup and returns the tokens for it. No surrounding
 // elements (e.g. paragraph start and end) are included.
-void PodParser::parse_inline(std::string para)
+// `offset' is the position of `para' inside m_current_buffer
+// for diagnostics, or std::string::npos if unknown.
+void PodParser::parse_inline(const std::string& para, size_t offset)
 {
-    struct markupel {
-        size_t angle_count;
-        mtype type;
-    };
+    size_t first_token = m_stream.Size();
+    mark_structural(para, m_inline_bits);
 
-    std::stack<markupel> inline_stack;
-    markupel mel;
+    std::vector<markup_element>& inline_stack = m_inline_stack;
+    inline_stack.clear();
+    markup_element mel;
     for (size_t pos=0; pos < para.length(); pos++) {
         if (para[pos+1] == '<') { // Start of inline markup
             mel.angle_count = 0;
@@ -405,113 +1175,133 @@ void PodParser::parse_inline(std::string para)
                 pos++;
             }
 
+            size_t codepos = offset == std::string::npos ? offset : offset + pos - mel.angle_count;
             if (is_inline_mode_active(mtype::zap)) {
-                std::cerr << "Warning on line " << m_lino << ": Z<> may not contain further formatting codes" << std::endl;
+                if (diagnostic_wanted(DiagnosticCode::code_inside_zap))
+                    diagnose(DiagnosticCode::code_inside_zap, codepos, "Z<> may not contain further formatting codes");
             }
             else if (is_inline_mode_active(mtype::escape)) {
-                std::cerr << "Warning on line " << m_lino << ": E<> may not contain further formatting codes" << std::endl;
+                if (diagnostic_wanted(DiagnosticCode::code_inside_escape))
+                    diagnose(DiagnosticCode::code_inside_escape, codepos, "E<> may not contain further formatting codes");
             }
             else if (is_inline_mode_active(mtype::index)) {
-                std::cerr << "Warning on line " << m_lino << ": X<> may not contain further formatting codes" << std::endl;
+                if (diagnostic_wanted(DiagnosticCode::code_inside_index))
+                    diagnose(DiagnosticCode::code_inside_index, codepos, "X<> may not contain further formatting codes");
             }
             else if (m_link_bar_found) {
-                std::cerr << "Warning on line " << m_lino << ": L<>'s link target may not contain formatting codes" << std::endl;
+                if (diagnostic_wanted(DiagnosticCode::code_inside_link_target))
+                    diagnose(DiagnosticCode::code_inside_link_target, codepos, "L<>'s link target may not contain formatting codes");
             }
 
-            mel.type = mtype::none;
             switch (para[pos-mel.angle_count]) {
             case 'I':
                 mel.type = mtype::italic;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'B':
                 mel.type = mtype::bold;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'C':
                 mel.type = mtype::code;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'F':
                 mel.type = mtype::filename;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'X':
                 mel.type = mtype::index;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'Z':
                 mel.type = mtype::zap;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'L':
                 mel.type = mtype::link;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'E':
                 mel.type = mtype::escape;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             case 'S':
                 mel.type = mtype::nbsp;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             default:
-                std::cerr << "Warning on line " << m_lino << ": Ignoring unknown formatting code '" << para[pos] << "'" << std::endl;
+                if (diagnostic_wanted(DiagnosticCode::unknown_formatting_code))
+                    diagnose(DiagnosticCode::unknown_formatting_code, codepos,
+                             std::string("Ignoring unknown formatting code '") + para[pos-mel.angle_count] + "'");
                 mel.type = mtype::none;
-                m_tokens.push_back(new PodNodeInlineMarkupStart(mel.type));
                 break;
             }
+            add_markup_start(mel.type);
 
             // Strip leading spaces
             while (para[pos+1] == ' ')
                 pos++;
 
-            inline_stack.push(mel);
+            inline_stack.push_back(mel);
         }
         else if (inline_stack.size() > 0 && para[pos] == '>') { // End of inline markup
-            mel = inline_stack.top();
+            mel = inline_stack.back();
             std::string angles(mel.angle_count, '>');
 
             // Retrieve preceeding inline text, if there's any (there's none
             // immediately following an opening markup token).
-            PodNodeInlineText* p_prectext = dynamic_cast<PodNodeInlineText*>(m_tokens.back());
+            size_t last = m_stream.Size() - 1;
+            bool has_prectext = m_stream.GetNtype(last) == ntype::text;
 
             // Check if this is a valid markup close or just stray angle brackets
             if (para.substr(pos, mel.angle_count) == angles) { // Valid
-                inline_stack.pop();
+                inline_stack.pop_back();
                 pos += mel.angle_count - 1; // pos is increased by loop statement by 1 again
 
                 // Strip trailing whitespace of preceeding text
-                if (p_prectext)
-                    p_prectext->StripTrailingWhitespace();
+                if (has_prectext) {
+                    PodStringRef text = m_stream.GetPayload(last);
+                    size_t length = text.Size();
+                    while (length > 0 && text[length-1] == ' ')
+                        length--;
+                    m_stream.truncate_payload(last, length);
+                }
 
                 // Insert End marker
                 switch (mel.type) {
-                case mtype::escape:
-                    m_tokens.push_back(new PodNodeInlineMarkupEnd(mel.type, {m_ecode}));
-                    m_ecode.clear(); // E<> may not nest
+                case mtype::escape: {
+                    // E<> is replaced with the character it stands
+                    // for, so no markup tokens remain.
+                    size_t start = find_preceeding_inline_markup_start(mtype::escape);
+                    m_stream.erase(start, start + 1);
+                    m_open_markup[static_cast<int>(mtype::escape)]--;
+
+                    std::string utf8;
+                    if (!resolve_escape_code(m_ecode, utf8)) {
+                        if (diagnostic_wanted(DiagnosticCode::unknown_escape_code))
+                            diagnose(DiagnosticCode::unknown_escape_code, offset == std::string::npos ? offset : offset + pos,
+                                     "Unknown escape code '" + m_ecode + "'");
+                        utf8 = "&" + m_ecode + ";"; // Shown as written before, as browsers do
+                    }
+                    if (!m_link_bar_found) {
+                        html_escape(utf8, is_inline_mode_active(mtype::nbsp));
+                        add_text(utf8);
+                    }
+                    m_ecode.clear(); } // E<> may not nest
                     break;
                 case mtype::index: {
                     std::string target(m_idx_kw);
                     std::replace(target.begin(), target.end(), ' ', '_');
 
-                    m_tokens.push_back(new PodNodeInlineMarkupEnd(mel.type, {target}));
-                    m_idx_keywords[m_idx_kw] = target;
+                    m_stream.set_payload(find_preceeding_inline_markup_start(mtype::index), m_idx_kw);
+                    add_markup_end(mel.type, target);
+                    if (!m_scratch_parse)
+                        m_idx_keywords[m_idx_kw] = target;
                     m_idx_kw.clear(); } // X<> may not nest
                     break;
-                case mtype::link: {
-                    PodNodeInlineMarkupStart* p_lstart = find_preceeding_inline_markup_start(mtype::link);
-                    p_lstart->AddArgument(m_link_content);
-                    p_lstart->SetFilenameCallback(m_filename_cb);
-                    p_lstart->SetMethodnameCallback(m_mname_cb);
+                case mtype::link:
+                    check_link_target(offset == std::string::npos ? offset : offset + pos);
+                    add_link(offset == std::string::npos ? offset : offset + pos);
+                    m_stream.set_payload(find_preceeding_inline_markup_start(mtype::link), m_link_content);
 
-                    m_tokens.push_back(new PodNodeInlineMarkupEnd(mel.type));
+                    add_markup_end(mel.type);
                     m_link_bar_found = false;
-                    m_link_content.clear(); } // L<> may not nest
+                    m_link_content.clear(); // L<> may not nest
                     break;
                 default:
-                    m_tokens.push_back(new PodNodeInlineMarkupEnd(mel.type));
+                    add_markup_end(mel.type);
                     break;
                 }
             }
@@ -521,10 +1311,7 @@ void PodParser::parse_inline(std::string para)
                 // make a new text node.
                 std::string s(para.substr(pos, 1));
                 html_escape(s);
-                if (p_prectext)
-                    p_prectext->AddText(s);
-                else
-                    m_tokens.push_back(new PodNodeInlineText(s));
+                add_text(s);
 
                 // Same as below for normal actual text
                 if (is_inline_mode_active(mtype::link)) {
@@ -533,11 +1320,20 @@ void PodParser::parse_inline(std::string para)
             }
         }
         else { // No inline markup: plain text
+            // All of it up to the next structural byte, or up to the
+            // letter of the formatting code there, is taken at once.
+            // A structural byte at `pos' itself is taken alone.
+            size_t end = next_structural(m_inline_bits, pos, para.length());
+            if (end == pos)
+                end = pos + 1;
+            else if (end < para.length() && para[end] == '<')
+                end--;
+
             if (is_inline_mode_active(mtype::escape)) { // Escape code
-                m_ecode += para.substr(pos, 1);
+                m_ecode.append(para, pos, end - pos);
             }
             else if (is_inline_mode_active(mtype::index)) { // Index code
-                m_idx_kw += para.substr(pos, 1);
+                m_idx_kw.append(para, pos, end - pos);
             }
             else { // Actual text
                 /* L<> content handling; the parser needs the entire
@@ -550,68 +1346,463 @@ void PodParser::parse_inline(std::string para)
                  * any kind of formatting markup in the link *target* is
                  * unsupported (this is a deviation from canonical POD markup). */
                 if (is_inline_mode_active(mtype::link)) {
-                    m_link_content += para.substr(pos, 1);
+                    m_link_content.append(para, pos, end - pos);
 
                     if (para[pos] == '|') {
                         m_link_bar_found = true;
                     }
                 }
-                if (m_link_bar_found) // Visible link text has ended
-                    continue;
-
-                // Append to last text node if exists, otherwise
-                // make a new text node.
-                PodNodeInlineText* p_prectext = dynamic_cast<PodNodeInlineText*>(m_tokens.back());
-                std::string s(para.substr(pos, 1));
-                html_escape(s, is_inline_mode_active(mtype::nbsp));
-                if (p_prectext)
-                    p_prectext->AddText(s);
-                else
-                    m_tokens.push_back(new PodNodeInlineText(s));
+                if (!m_link_bar_found) { // Visible link text has not ended
+                    m_inline_text.assign(para, pos, end - pos);
+                    html_escape(m_inline_text, is_inline_mode_active(mtype::nbsp));
+                    add_text(m_inline_text, offset == std::string::npos ? offset : source_offset(offset + pos));
+                }
             }
+            pos = end - 1; // pos is increased by loop statement by 1 again
         }
     }
 
     // Handle Z<> formatting codes
-    zap_tokens();
+    zap_tokens(first_token);
+}
+
+// Append `text' to the last token if it is a text token, otherwise
+// add a new text token. `source_offset' is where `text' was taken
+// from in the source, or std::string::npos if unknown.
+void PodParser::add_text(const std::string& text, size_t source_offset)
+{
+    size_t last = m_stream.Size() - 1;
+    if (m_stream.Size() > 0 && m_stream.GetNtype(last) == ntype::text)
+        m_stream.append_payload(last, text, source_offset);
+    else
+        m_stream.add(ntype::text, 0, text, source_offset);
+}
+
+// Makes the anchor for a heading with text `title', which is unique
+// in this document: repeated titles get "-2", "-3", etc. appended.
+std::string PodParser::register_anchor(const std::string& title)
+{
+    std::string base = MakeHeadingAnchorName(title);
+    std::string anchor = base;
+    for (unsigned int n=2; !m_anchors.insert(anchor).second; n++) {
+        anchor = base + "-" + std::to_string(n);
+    }
+
+    m_heading_anchors.insert(std::make_pair(title, anchor)); // Keeps the first
+    return anchor;
+}
+
+/* Links to sections of this document (L</section>, L</"section">
+ * or L<"section">, with or without a text) get the anchor of the
+ * heading they refer to, which may come after the link: their
+ * target becomes "/#anchor". Links to sections without a heading
+ * are left as they are. */
+void PodParser::resolve_section_links()
+{
+    for (size_t i=0; i < m_stream.Size(); i++)
+        resolve_section_link(m_stream, i);
+}
+
+// Does the above for token `token' of `stream' if it starts a link.
+void PodParser::resolve_section_link(PodTokenStream& stream, size_t token) const
+{
+    if (stream.GetNtype(token) != ntype::markup_start || stream.GetMtype(token) != mtype::link)
+        return;
+
+    PodStringRef link = stream.GetPayload(token);
+    const char* p_bar = static_cast<const char*>(memchr(link.Data(), '|', link.Size()));
+    size_t target = p_bar ? p_bar - link.Data() + 1 : 0;
+    if (target >= link.Size() || (link[target] != '/' && link[target] != '"'))
+        return;
+
+    PodLinkTarget section = parse_link_target(std::string(link.Data() + target, link.Size() - target));
+    if (section.kind != LinkKind::section || !section.document.empty())
+        return;
+
+    // The link text is kept; link_href() takes "/#anchor" as it is
+    auto iter = m_heading_anchors.find(section.name);
+    if (iter != m_heading_anchors.end())
+        stream.set_payload(token, std::string(link.Data(), target) + "/#" + iter->second);
+}
+
+/* Records the sections of the document for RenderSection(). The
+ * section of a heading reaches up to the next heading of the same or
+ * a higher level. The section of an =item is that item; it is found
+ * by its definition term or, for other lists, the text of its first
+ * paragraph. The first of several sections of the same name wins.
+ * For each section, the lists and items it is inside of are
+ * recorded, so that it can be rendered without looking at the tokens
+ * before it. This is done on the first call of FindSection() or
+ * RenderSection() only, so that parsing does not pay for it. */
+void PodParser::index_sections()
+{
+    m_sections.clear();
+    m_blocks.clear();
+    m_heading_sections.clear();
+    m_item_sections.clear();
+    m_sections_indexed = true;
+
+    std::vector<size_t> open_headings; // Index into m_sections
+    std::vector<size_t> open_items;    // Index into m_sections, or npos
+    size_t enclosing = std::string::npos;
+    for (size_t i=0; i < m_stream.Size(); i++) {
+        switch (m_stream.GetNtype(i)) {
+        case ntype::head_start: {
+            int level = m_stream.GetLevel(i);
+            while (!open_headings.empty() && m_stream.GetLevel(m_sections[open_headings.back()].first_token) >= level) {
+                m_sections[open_headings.back()].last_token = i;
+                open_headings.pop_back();
+            }
+
+            section heading = {i, m_stream.Size(), enclosing};
+            if (m_heading_sections.insert(std::make_pair(m_stream.GetPayload(i).ToString(), m_sections.size())).second) {
+                open_headings.push_back(m_sections.size());
+                m_sections.push_back(heading);
+            }
+            break; }
+        case ntype::over:
+            m_blocks.push_back(block{i, enclosing});
+            enclosing = m_blocks.size() - 1;
+            break;
+        case ntype::item_start: {
+            std::string label = item_label(i);
+            size_t index = std::string::npos;
+            if (!label.empty() && m_item_sections.insert(std::make_pair(label, m_sections.size())).second) {
+                index = m_sections.size();
+                m_sections.push_back(section{i, m_stream.Size(), enclosing});
+            }
+            open_items.push_back(index);
+            m_blocks.push_back(block{i, enclosing});
+            enclosing = m_blocks.size() - 1;
+            break; }
+        case ntype::item_end:
+        case ntype::back:
+            // An =item ends at its item_end, an =over at its back
+            if (enclosing != std::string::npos && m_stream.GetNtype(m_blocks[enclosing].token) == ntype::item_start) {
+                if (open_items.back() != std::string::npos)
+                    m_sections[open_items.back()].last_token = i + 1;
+                open_items.pop_back();
+                enclosing = m_blocks[enclosing].parent;
+            }
+            if (m_stream.GetNtype(i) == ntype::back && enclosing != std::string::npos)
+                enclosing = m_blocks[enclosing].parent;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// The label of the =item starting with item_start token `token':
+// its definition term or, for other lists, the text of its first
+// paragraph.
+std::string PodParser::item_label(size_t token) const
+{
+    std::string label;
+    if (m_stream.GetListType(token) == OverListType::description) {
+        PodStringRef term = m_stream.GetPayload(token);
+        label.assign(term.Data() + 1, term.Size() >= 2 ? term.Size() - 2 : 0); // Without []
+    }
+    else if (token + 1 < m_stream.Size() && m_stream.GetNtype(token + 1) == ntype::para_start) {
+        size_t end = token + 2;
+        while (end < m_stream.Size() && m_stream.GetNtype(end) != ntype::para_end)
+            end++;
+        label = plain_text(m_stream, token + 2, end);
+    }
+    return label;
+}
+
+std::vector<std::string> PodParser::GetItemLabels() const
+{
+    std::vector<std::string> labels;
+    for (size_t i=0; i < m_stream.Size(); i++) {
+        if (m_stream.GetNtype(i) != ntype::item_start)
+            continue;
+
+        std::string label = item_label(i);
+        if (!label.empty())
+            labels.push_back(label);
+    }
+    return labels;
+}
+
+/**
+ * Returns the first ordinary paragraph of the NAME section, i.e. the
+ * first one after the =head1 NAME heading and before the next
+ * heading, stripped of formatting codes. Returns the empty string if
+ * there is no such paragraph. In lazy mode, the paragraph is parsed
+ * with ParseParagraph() if need be.
+ */
+std::string PodParser::GetAbstract()
+{
+    for (const PodHeading& heading: m_outline) {
+        if (heading.level != 1 || heading.text != "NAME")
+            continue;
+
+        // The paragraph of an =item is not an ordinary one
+        size_t para = heading.last_token + 1;
+        while (para < m_stream.Size() && m_stream.GetNtype(para) != ntype::head_start
+               && (m_stream.GetNtype(para) != ntype::para_start || m_stream.GetNtype(para - 1) == ntype::item_start))
+            para++;
+        if (para >= m_stream.Size() || m_stream.GetNtype(para) != ntype::para_start)
+            return std::string();
+        if (IsPending(para)) {
+            const PodTokenStream& tokens = ParseParagraph(para);
+            return plain_text(tokens, 0, tokens.Size());
+        }
+
+        size_t end = para + 1;
+        while (end < m_stream.Size() && m_stream.GetNtype(end) != ntype::para_end)
+            end++;
+        return plain_text(m_stream, para + 1, end);
+    }
+    return std::string();
+}
+
+bool PodParser::FindSection(const std::string& name, size_t& first, size_t& last)
+{
+    if (!m_sections_indexed)
+        index_sections();
+
+    auto iter = m_heading_sections.find(name);
+    if (iter == m_heading_sections.end()) {
+        iter = m_item_sections.find(name);
+        if (iter == m_item_sections.end())
+            return false;
+    }
+
+    first = m_sections[iter->second].first_token;
+    last = m_sections[iter->second].last_token;
+    return true;
+}
+
+/**
+ * Renders the section under the heading with anchor `name' (see
+ * GetHeadingAnchors()), or if there is none, the =item labelled
+ * `name'. The lists and items the section is inside of are opened
+ * before and closed after it, so the HTML is balanced. Once the
+ * sections are indexed, this only looks at the section's own tokens,
+ * so it takes no longer for a section of a large document. Throws
+ * std::out_of_range if there is no such section.
+ */
+std::string PodParser::RenderSection(const std::string& name)
+{
+    if (!m_sections_indexed)
+        index_sections();
+
+    auto iter = m_heading_sections.find(name);
+    if (iter == m_heading_sections.end()) {
+        iter = m_item_sections.find(name);
+        if (iter == m_item_sections.end())
+            throw(std::out_of_range("No section '" + name + "'"));
+    }
+    const section& part = m_sections[iter->second];
+
+    // The =over and =item tokens the section is inside of, outermost first
+    std::vector<size_t> open;
+    for (size_t n=part.enclosing; n != std::string::npos; n=m_blocks[n].parent) {
+        open.push_back(m_blocks[n].token);
+    }
+    std::reverse(open.begin(), open.end());
+
+    PodHTMLRenderer renderer(m_filename_cb, m_mname_cb);
+    for (size_t token: open) {
+        renderer.Render(m_stream, token, token + 1);
+    }
+    for (size_t i=part.first_token; i < part.last_token; i++) {
+        switch (m_stream.GetNtype(i)) {
+        case ntype::over:
+        case ntype::item_start:
+            open.push_back(i);
+            break;
+        case ntype::item_end:
+            if (open.empty() || m_stream.GetNtype(open.back()) != ntype::item_start)
+                continue; // Closes nothing
+            open.pop_back();
+            break;
+        case ntype::back:
+            if (!open.empty() && m_stream.GetNtype(open.back()) == ntype::item_start)
+                open.pop_back();
+            if (open.empty())
+                continue;
+            open.pop_back();
+            break;
+        default:
+            break;
+        }
+        renderer.Render(m_stream, i, i + 1);
+        if (m_stream.GetNtype(i) == ntype::para_start && IsPending(i))
+            renderer.Render(ParseParagraph(i));
+    }
+
+    // Whatever is still open was opened in or before the section
+    for (auto iter=open.rbegin(); iter != open.rend(); iter++) {
+        if (m_stream.GetNtype(*iter) == ntype::item_start)
+            renderer.ItemEnd(m_stream.GetListType(*iter));
+        else
+            renderer.Back(m_stream.GetListType(*iter));
+    }
+
+    return std::move(renderer.GetResult());
+}
+
+void PodParser::add_markup_start(mtype t)
+{
+    m_stream.add(ntype::markup_start, static_cast<unsigned char>(t));
+    m_open_markup[static_cast<int>(t)]++;
+}
+
+void PodParser::add_markup_end(mtype t, const std::string& arg)
+{
+    m_stream.add(ntype::markup_end, static_cast<unsigned char>(t), arg);
+    m_open_markup[static_cast<int>(t)]--;
+}
+
+static DiagnosticSeverity diagnostic_severity(DiagnosticCode code)
+{
+    switch (code) {
+    case DiagnosticCode::encoding_ignored:
+        return DiagnosticSeverity::info;
+    case DiagnosticCode::invalid_command:
+    case DiagnosticCode::invalid_over_indent: // fall-through
+        return DiagnosticSeverity::error;
+    default:
+        return DiagnosticSeverity::warning;
+    }
+}
+
+// Reports problems with the link target in m_link_content, which
+// holds the complete content of an L<> code that is about to be
+// closed at m_current_buffer position `bufpos'.
+void PodParser::check_link_target(size_t bufpos)
+{
+    size_t pos = m_link_content.find('|');
+    std::string link_target = pos == std::string::npos ? m_link_content : m_link_content.substr(pos+1);
+
+    if (link_target.find('<') != std::string::npos) {
+        if (diagnostic_wanted(DiagnosticCode::markup_in_link_target))
+            diagnose(DiagnosticCode::markup_in_link_target, bufpos,
+                     "Use of formatting codes inside link target '" + link_target + "' is unsupported (deviation from canonical POD syntax)");
+    }
+
+    // Same classification as in PodNodeInlineMarkupStart::ToHTML().
+    std::string manpage;
+    std::string section;
+    if (link_target.find("://") == std::string::npos &&
+        !check_manpage(link_target, manpage, section) &&
+        link_target.find('#') == std::string::npos &&
+        link_target.find("::") == std::string::npos &&
+        (link_target.empty() || link_target == "/")) {
+        if (diagnostic_wanted(DiagnosticCode::empty_link_target))
+            diagnose(DiagnosticCode::empty_link_target, bufpos, "empty link target");
+    }
+}
+
+// Records the link in m_link_content, see check_link_target().
+void PodParser::add_link(size_t bufpos)
+{
+    if (m_scratch_parse)
+        return;
+
+    PodLink link;
+    size_t pos = m_link_content.find('|');
+    link.target = pos == std::string::npos ? m_link_content : m_link_content.substr(pos+1);
+    buffer_position(bufpos, link.line, link.column);
+    m_links.push_back(link);
+}
+
+// Converts the m_current_buffer position `bufpos' into a line and
+// column as described for PodDiagnostic.
+void PodParser::buffer_position(size_t bufpos, long& line, long& column)
+{
+    line   = m_para_lino;
+    column = 0;
+
+    if (bufpos != std::string::npos && !m_para_line_offsets.empty()) {
+        auto iter = std::upper_bound(m_para_line_offsets.begin(), m_para_line_offsets.end(), bufpos) - 1;
+        line  += iter - m_para_line_offsets.begin();
+        column = bufpos - *iter + 1;
+    }
+}
+
+// Returns whether a diagnostic of type `code' is to be reported at
+// all. Call this before building the message for diagnose() so that
+// filtered or rate-limited diagnostics cost next to nothing.
+bool PodParser::diagnostic_wanted(DiagnosticCode code)
+{
+    if (m_scratch_parse || m_scanning || diagnostic_severity(code) < m_diag_min_severity)
+        return false;
+
+    if (m_diag_limit > 0 && m_diag_counts[code] >= m_diag_limit) {
+        m_diag_suppressed++;
+        return false;
+    }
+    return true;
+}
+
+// Issue a diagnostic for the m_current_buffer position `bufpos'
+// (std::string::npos if unknown). An exact repetition of the
+// previous diagnostic is only counted as suppressed, and does not
+// count towards the limit of its DiagnosticCode.
+void PodParser::diagnose(DiagnosticCode code, size_t bufpos, const std::string& message)
+{
+    PodDiagnostic diag;
+    diag.code     = code;
+    diag.severity = diagnostic_severity(code);
+    diag.message  = message;
+    buffer_position(bufpos, diag.line, diag.column);
+
+    if (diag.code == m_last_diagnostic.code &&
+        diag.line == m_last_diagnostic.line &&
+        diag.message == m_last_diagnostic.message) {
+        m_diag_suppressed++;
+        return;
+    }
+    m_last_diagnostic = diag;
+    m_diag_counts[code]++;
+
+    if (m_diag_cb)
+        m_diag_cb(diag, m_diag_userdata);
+    else
+        m_diagnostics.push_back(diag);
 }
 
-// Finds the preceeding =item on the same =over level.
-// If there is none, returns nullptr.
-PodNodeItemStart* PodParser::find_preceeding_item() {
-    PodNodeItemStart* p_item = nullptr;
+// Finds the preceeding =item on the same =over level and returns
+// its index in m_stream. If there is none, returns std::string::npos.
+size_t PodParser::find_preceeding_item() {
     int level = 0;
 
-    for(auto iter=m_tokens.rbegin(); iter != m_tokens.rend(); iter++) {
-        if (dynamic_cast<PodNodeBack*>(*iter))
+    for (size_t i=m_stream.Size(); i-- > 0;) {
+        ntype t = m_stream.GetNtype(i);
+        if (t == ntype::back)
             level++;
-        else if (dynamic_cast<PodNodeOver*>(*iter)) {
+        else if (t == ntype::over) {
             if (level == 0) // Terminate search if enclosing =over is found
                 break;
             else
                 level--;
         }
-        else if (level == 0 && (p_item = dynamic_cast<PodNodeItemStart*>(*iter)))
-            return p_item;         //  ^ Single "=" intended
+        else if (level == 0 && t == ntype::item_start)
+            return i;
     }
 
-    return nullptr; // No preceeding =item on the same level
+    return std::string::npos; // No preceeding =item on the same level
 }
 
-// Finds the =over that corresponds to the current indent level.
-// If there is none (i.e. currently outside =over block),
-// returns nullptr.
-PodNodeOver* PodParser::find_preceeding_over() {
-    PodNodeOver* p_over = nullptr;
+// Finds the =over that corresponds to the current indent level and
+// returns its index in m_stream. If there is none (i.e. currently
+// outside =over block), returns std::string::npos.
+size_t PodParser::find_preceeding_over() {
     int level = 0;
 
-    for(auto iter=m_tokens.rbegin(); iter != m_tokens.rend(); iter++) {
-        if (dynamic_cast<PodNodeBack*>(*iter)) {
+    for (size_t i=m_stream.Size(); i-- > 0;) {
+        ntype t = m_stream.GetNtype(i);
+        if (t == ntype::back) {
             level++;
         }
-        else if ((p_over = dynamic_cast<PodNodeOver*>(*iter))) { // Single = intended
+        else if (t == ntype::over) {
             if (level == 0) {
-                return p_over;
+                return i;
             }
             else {
                 level--;
@@ -619,30 +1810,30 @@ PodNodeOver* PodParser::find_preceeding_over() {
         }
     }
 
-    return nullptr; // Not inside an =over block
+    return std::string::npos; // Not inside an =over block
 }
 
-// Assumes an open formatting code and finds the PodNodeInlineMarkupStart*
-// that opened it, returning it. If `t' is mtype::none, any
-// opening PodNodeInlineMarkupStart* suffices, otherwise the
-// search is restricted to those of type `t'.
-PodNodeInlineMarkupStart* PodParser::find_preceeding_inline_markup_start(mtype t)
+// Assumes an open formatting code and finds the markup_start token
+// that opened it, returning its index. If `t' is mtype::none, any
+// opening markup_start suffices, otherwise the search is restricted
+// to those of type `t'.
+size_t PodParser::find_preceeding_inline_markup_start(mtype t)
 {
-    PodNodeInlineMarkupStart* p_mstart = nullptr;
     int level = 0;
 
-    for (auto iter=m_tokens.rbegin(); iter != m_tokens.rend(); iter++) {
-        if (dynamic_cast<PodNodeInlineMarkupEnd*>(*iter)) {
+    for (size_t i=m_stream.Size(); i-- > 0;) {
+        ntype nt = m_stream.GetNtype(i);
+        if (nt == ntype::markup_end) {
             level++;
         }
-        else if (level > 0 && dynamic_cast<PodNodeInlineMarkupStart*>(*iter)) {
+        else if (level > 0 && nt == ntype::markup_start) {
             level--;
         }
-        else if (level == 0 && (p_mstart = dynamic_cast<PodNodeInlineMarkupStart*>(*iter))) {
+        else if (level == 0 && nt == ntype::markup_start) {
             if (t == mtype::none)
-                return p_mstart;
-            else if (p_mstart->GetMtype() == t)
-                return p_mstart;
+                return i;
+            else if (m_stream.GetMtype(i) == t)
+                return i;
         }
     }
 
@@ -652,56 +1843,39 @@ PodNodeInlineMarkupStart* PodParser::find_preceeding_inline_markup_start(mtype t
 // Checks if the parser at the current point is inside an opened
 // formatting code of type `t'. This function takes care of nesting
 // for all modes, even though nesting is not useful for all modes
-// (notably mtype::nbsp).
+// (notably mtype::nbsp). The open codes are counted as tokens are
+// added and removed, so this does not need to look at the tokens.
 bool PodParser::is_inline_mode_active(mtype t)
 {
-    PodNodeInlineMarkupEnd* p_mend = nullptr;
-    PodNodeInlineMarkupStart* p_mstart = nullptr;
-    int level = 0;
-
-    for(auto iter=m_tokens.rbegin(); iter != m_tokens.rend(); iter++) {
-        if ((p_mend = dynamic_cast<PodNodeInlineMarkupEnd*>(*iter))) { // Single = intended
-            if (p_mend->GetMtype() == t) {
-                level--;
-            }
-        }
-        else if ((p_mstart = dynamic_cast<PodNodeInlineMarkupStart*>(*iter))) { // Single = intended
-            if (p_mstart->GetMtype() == t) {
-                level++;
-            }
-        }
-    }
-
-    return level > 0;
+    return m_open_markup[static_cast<int>(t)] > 0;
 }
 
 // Evaluate the Z<> formatting code. This function erases from
-// m_tokens everything between a PodNodeInlineMarkupStart of type
-// mtype::zap and the corresponding PodNodeInlineMarkupEnd. If in a
-// paragraph, heading, or item no PodNodeInlineMarkupEnd is found, the
-// block's ending terminates zap mode (this caters for missing closing
-// ">").
-void PodParser::zap_tokens()
-{
-    PodNodeInlineMarkupEnd*   p_mend   = nullptr;
-    PodNodeInlineMarkupStart* p_mstart = nullptr;
+// m_stream everything between a markup_start of type mtype::zap and
+// the corresponding markup_end, starting the search at token index
+// `first' (earlier blocks have already been processed). If in a
+// paragraph, heading, or item no markup_end is found, the block's
+// ending terminates zap mode (this caters for missing closing ">").
+void PodParser::zap_tokens(size_t first)
+{
     bool erase = false;
     int  level = 0;
+    size_t dest = first;
+
+    for (size_t i=first; i < m_stream.Size(); i++) {
+        ntype t = m_stream.GetNtype(i);
 
-    for(auto iter=m_tokens.begin(); iter != m_tokens.end(); iter++) {
         // Always terminate Z<> mode if the end of the current
         // block is reached while Z mode is active (i.e. missing
         // closing ">").
-        if ((level > 0) && (dynamic_cast<PodNodeHeadEnd*>(*iter) ||
-                            dynamic_cast<PodNodeItemEnd*>(*iter) ||
-                            dynamic_cast<PodNodeParaEnd*>(*iter))) {
+        if ((level > 0) && (t == ntype::head_end ||
+                            t == ntype::item_end ||
+                            t == ntype::para_end)) {
             level = 0;
-            continue;
         }
-
         // Check for zap mode formatting codes
-        if ((p_mstart = dynamic_cast<PodNodeInlineMarkupStart*>(*iter))) { // Single = intended
-            if (p_mstart->GetMtype() == mtype::zap) {
+        else if (t == ntype::markup_start) {
+            if (m_stream.GetMtype(i) == mtype::zap) {
                 if (level > 0) {
                     erase = true;
                 }
@@ -709,8 +1883,8 @@ void PodParser::zap_tokens()
                 level++;
             }
         }
-        else if ((p_mend = dynamic_cast<PodNodeInlineMarkupEnd*>(*iter))) { // Single = intended
-            if (p_mend->GetMtype() == mtype::zap) {
+        else if (t == ntype::markup_end) {
+            if (m_stream.GetMtype(i) == mtype::zap) {
                 level--;
 
                 if (level > 0) {
@@ -722,77 +1896,75 @@ void PodParser::zap_tokens()
             erase = true;
         }
 
-        // If inside zap mode, erase token.
+        // If inside zap mode, drop the token, otherwise keep it
+        // by moving it down over the dropped ones.
         if (erase) {
             erase = false;
-            iter = m_tokens.erase(iter);
-            if (iter == m_tokens.end())
-                break;
-            else
-                iter--;
+            if (t == ntype::markup_start)
+                m_open_markup[static_cast<int>(mtype::zap)]--;
+            else if (t == ntype::markup_end)
+                m_open_markup[static_cast<int>(mtype::zap)]++;
+        }
+        else {
+            m_stream.move(i, dest++);
         }
     }
+
+    m_stream.erase(dest, m_stream.Size());
 }
 
+// Maps every character to itself if it is allowed in an anchor
+// name, and to '-' otherwise.
+struct anchor_char_table
+{
+    anchor_char_table()
+    {
+        for (int ch=0; ch < 256; ch++) {
+            bool allowed = (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z');
+            chars[ch] = allowed ? static_cast<char>(ch) : '-';
+        }
+    }
+
+    char chars[256];
+};
+
 /**
  * Processes `title' so that it can be used for an HTML A tag's
  * NAME attribute. The result is returned.
  */
 std::string PodParser::MakeHeadingAnchorName(const std::string& title)
 {
-    std::string result;
+    static const anchor_char_table table;
+
+    std::string result(title.length(), '-');
     for (size_t i=0; i < title.length(); i++) {
-        if (title[i] >= '0' && title[i] <= '9')
-            result += title[i];
-        else if (title[i] >= 'A' && title[i] <= 'Z')
-            result += title[i];
-        else if (title[i] >= 'a' && title[i] <= 'z')
-            result += title[i];
-        else
-            result += '-';
+        result[i] = table.chars[static_cast<unsigned char>(title[i])];
     }
     return result;
 }
 
 /***************************************
- * Pod nodes
+ * HTML generation
  **************************************/
 
-PodNodeHeadStart::PodNodeHeadStart(int level, std::string content)
-    : m_level(level),
-      m_content(content)
-{
-}
-
-std::string PodNodeHeadStart::ToHTML() const
-{
-    return std::string("<h" + std::to_string(m_level) + " id=\"" + PodParser::MakeHeadingAnchorName(m_content) + "\">");
-}
-
-PodNodeHeadEnd::PodNodeHeadEnd(int level)
-    : m_level(level)
-{
-}
-
-std::string PodNodeHeadEnd::ToHTML() const
-{
-    return std::string("</h" + std::to_string(m_level) + ">\n");
-}
+/* These functions generate the HTML for the individual tokens. They
+ * are shared by the PodNode::ToHTML() implementations and by
+ * FormatHTML() for PodTokenStream, which both have to produce
+ * exactly the same output. */
 
-PodNodeOver::PodNodeOver(float indent)
-    : m_indent(indent),
-      m_list_type(OverListType::unordered)
+static std::string head_start_html(int level, const std::string& anchor)
 {
+    return std::string("<h" + std::to_string(level) + " id=\"" + anchor + "\">");
 }
 
-void PodNodeOver::SetListType(OverListType t)
+static std::string head_end_html(int level)
 {
-    m_list_type = t;
+    return std::string("</h" + std::to_string(level) + ">\n");
 }
 
-std::string PodNodeOver::ToHTML() const
+static const char* over_html(OverListType t)
 {
-    switch (m_list_type) {
+    switch (t) {
     case OverListType::unordered:
         return "<ul>";
     case OverListType::ordered:
@@ -804,67 +1976,30 @@ std::string PodNodeOver::ToHTML() const
     throw(std::runtime_error("This should never be reached"));
 }
 
-/* Construct a new list item start. The list type is determined
- * from the label: if it is a "*", then it's an unordered list,
- * if it's a stringified number it's an ordered list, and if
- * it's anything else then it's a description list. For description
- * list items, the label is actually printed in the <dt/> element on
- * HTML output via ToHTML(). */
-PodNodeItemStart::PodNodeItemStart(std::string label)
-    : m_label(label)
-{
-    if (m_label[0] == '*')
-        m_list_type = OverListType::unordered;
-    else if (m_label[0] >= '0' && m_label[0] <= '9')
-        m_list_type = OverListType::ordered;
-    else
-        m_list_type = OverListType::description;
-}
-
-const std::string& PodNodeItemStart::GetLabel() const
-{
-    return m_label;
-}
-
-OverListType PodNodeItemStart::GetListType() const
-{
-    return m_list_type;
-}
-
-std::string PodNodeItemStart::ToHTML() const
+static std::string item_start_html(OverListType t, const std::string& label)
 {
-    switch (m_list_type) {
+    switch (t) {
     case OverListType::unordered:
     case OverListType::ordered: // fall-through
         return "<li>";
     case OverListType::description:
-        return std::string("<dt>") + m_label.substr(1, m_label.length() - 2) + "</dt><dd>";
+        return std::string("<dt>") + (label.length() >= 2 ? label.substr(1, label.length() - 2) : std::string()) + "</dt><dd>";
     } // No default -- all overListType values are handled
 
-    throw(std::string("This should never be reached"));
-}
-
-PodNodeItemEnd::PodNodeItemEnd(OverListType t)
-    : m_list_type(t)
-{
+    throw(std::runtime_error("This should never be reached"));
 }
 
-std::string PodNodeItemEnd::ToHTML() const
+static const char* item_end_html(OverListType t)
 {
-    if (m_list_type == OverListType::description)
+    if (t == OverListType::description)
         return "</dd>";
     else
         return "</li>";
 }
 
-PodNodeBack::PodNodeBack(OverListType t)
-    : m_list_type(t)
-{
-}
-
-std::string PodNodeBack::ToHTML() const
+static const char* back_html(OverListType t)
 {
-    switch (m_list_type) {
+    switch (t) {
     case OverListType::unordered:
         return "</ul>\n";
     case OverListType::ordered:
@@ -876,264 +2011,2324 @@ std::string PodNodeBack::ToHTML() const
     throw(std::runtime_error("This should never be reached"));
 }
 
-std::string PodNodeParaStart::ToHTML() const
-{
-    return "<p>";
-}
-
-std::string PodNodeParaEnd::ToHTML() const
+// HTML for starting formatting code `t'. mtype::link is handled
+// by link_start_html().
+static const char* markup_start_html(mtype t)
 {
-    return "</p>\n";
-}
+    switch (t) {
+    case mtype::none:
+    case mtype::nbsp:   // fall-through
+    case mtype::zap:    // fall-through
+    case mtype::escape: // fall-through
+    case mtype::index:  // fall-through
+        return "";
+    case mtype::italic:
+        return "<i>";
+    case mtype::bold:
+        return "<b>";
+    case mtype::code:
+        return "<tt>";
+    case mtype::filename:
+        return "<span class=\"filename\">";
+    case mtype::link:
+        break;
+    }
 
-PodNodeInlineText::PodNodeInlineText(std::string text)
-    : m_text(text)
-{
+    throw(std::runtime_error("This should never be reached"));
 }
 
-PodNodeInlineText::PodNodeInlineText(char ch)
-    : m_text(1, ch)
+// HTML for ending formatting code `t'. mtype::escape and
+// mtype::index are handled by escape_html() and index_html().
+static const char* markup_end_html(mtype t)
 {
-}
-
-void PodNodeInlineText::AddText(const std::string& text) {
-    m_text += text;
-}
-
-void PodNodeInlineText::AddText(char ch) {
-    m_text += std::string(1, ch);
-}
-
-void PodNodeInlineText::StripTrailingWhitespace() {
-    while (!m_text.empty() && m_text[m_text.length()-1] == ' ') {
-        m_text = m_text.substr(0, m_text.length() - 1);
+    switch (t) {
+    case mtype::none:
+    case mtype::nbsp: // fall-through
+    case mtype::zap:  // fall-through
+        return "";
+    case mtype::italic:
+        return "</i>";
+    case mtype::bold:
+        return "</b>";
+    case mtype::code:
+        return "</tt>";
+    case mtype::filename:
+        return "</span>";
+    case mtype::link:
+        return "</a>";
+    case mtype::escape:
+    case mtype::index: // fall-through
+        break;
+    }
+
+    throw(std::runtime_error("This should never be reached"));
+}
+
+// The parser resolves E<> itself; this is for PodNodeInlineMarkupEnd
+// instances made elsewhere.
+static std::string escape_html(const std::string& ecode)
+{
+    std::string utf8;
+    if (resolve_escape_code(ecode, utf8)) {
+        html_escape(utf8);
+        return utf8;
+    }
+    else
+        return std::string("&") + ecode + ";";
+}
+
+static std::string index_html(const std::string& target)
+{
+    return std::string("<a class=\"idxentry\" name=\"idx-") + target + "\"></a>";
+}
+
+// Link target for L<> with the content `link'.
+static std::string link_href(const std::string& link,
+                             std::string (*filename_cb)(std::string),
+                             std::string (*mname_cb)(bool, std::string))
+{
+    size_t pos = link.find('|');
+    pos = pos == std::string::npos ? 0 : pos + 1;
+    if (link.compare(pos, 2, "/#") == 0) // Resolved by PodParser::resolve_section_links()
+        return link.substr(pos + 1);
+
+    PodLinkTarget target = parse_link_target(link.substr(pos));
+
+    switch (target.kind) {
+    case LinkKind::url:
+        return target.name;
+    case LinkKind::manpage:
+        return std::string("https://linux.die.net/man/") + target.name + "/" + target.document;
+    case LinkKind::document:
+        return filename_cb(target.document);
+    case LinkKind::section: // Empty document means link to section in current document
+        return (target.document.empty() ? "" : filename_cb(target.document))
+            + "#" + PodParser::MakeHeadingAnchorName(target.name);
+    default: // Method doc in this or a different document
+        return (target.document.empty() ? "" : filename_cb(target.document))
+            + "#" + mname_cb(target.kind == LinkKind::class_method, target.name);
+    }
+}
+
+// Opening A tag for L<> with the content `link'.
+static std::string link_start_html(const std::string& link,
+                                   std::string (*filename_cb)(std::string),
+                                   std::string (*mname_cb)(bool, std::string))
+{
+    return std::string("<a href=\"") + link_href(link, filename_cb, mname_cb) + "\">";
+}
+
+// Data regions can be large, so these two append to `result'
+// instead of returning a string.
+static void append_data_html(std::string& result, PodStringRef format, PodStringRef data)
+{
+    if (format.Size() == 4 && memcmp(format.Data(), "html", 4) == 0)
+        result.append(data.Data(), data.Size());
+}
+
+static void append_verbatim_html(std::string& result, PodStringRef text, size_t indent)
+{
+    result += "<pre>";
+    append_unindented(result, text, indent);
+    result += "</pre>\n";
+}
+
+/***************************************
+ * Pod nodes
+ **************************************/
+
+PodText PodText::Borrow(PodStringRef ref)
+{
+    PodText text;
+    text.m_ref = ref;
+    return text;
+}
+
+void PodText::Append(const std::string& text)
+{
+    if (IsBorrowed()) {
+        m_owned = m_ref.ToString();
+        m_ref = PodStringRef(nullptr, 0);
+    }
+
+    m_owned += text;
+}
+
+void PodText::Truncate(size_t length)
+{
+    if (IsBorrowed())
+        m_ref = PodStringRef(m_ref.Data(), length);
+    else
+        m_owned.resize(length);
+}
+
+PodNodeHeadStart::PodNodeHeadStart(int level, std::string anchor)
+    : m_level(level),
+      m_anchor(anchor)
+{
+}
+
+std::string PodNodeHeadStart::ToHTML() const
+{
+    return head_start_html(m_level, m_anchor);
+}
+
+PodNodeHeadEnd::PodNodeHeadEnd(int level)
+    : m_level(level)
+{
+}
+
+std::string PodNodeHeadEnd::ToHTML() const
+{
+    return head_end_html(m_level);
+}
+
+PodNodeOver::PodNodeOver(float indent)
+    : m_indent(indent),
+      m_list_type(OverListType::unordered)
+{
+}
+
+void PodNodeOver::SetListType(OverListType t)
+{
+    m_list_type = t;
+}
+
+std::string PodNodeOver::ToHTML() const
+{
+    return over_html(m_list_type);
+}
+
+/* Construct a new list item start. The list type is determined
+ * from the label: if it is a "*", then it's an unordered list,
+ * if it's a stringified number it's an ordered list, and if
+ * it's anything else then it's a description list. For description
+ * list items, the label is actually printed in the <dt/> element on
+ * HTML output via ToHTML(). */
+PodNodeItemStart::PodNodeItemStart(std::string label)
+    : m_label(label),
+      m_list_type(ListTypeFromLabel(label))
+{
+}
+
+// Determines the list type from an =item label as described above.
+OverListType PodNodeItemStart::ListTypeFromLabel(const std::string& label)
+{
+    if (label[0] == '*')
+        return OverListType::unordered;
+    else if (label[0] >= '0' && label[0] <= '9')
+        return OverListType::ordered;
+    else
+        return OverListType::description;
+}
+
+const std::string& PodNodeItemStart::GetLabel() const
+{
+    return m_label;
+}
+
+OverListType PodNodeItemStart::GetListType() const
+{
+    return m_list_type;
+}
+
+std::string PodNodeItemStart::ToHTML() const
+{
+    return item_start_html(m_list_type, m_label);
+}
+
+PodNodeItemEnd::PodNodeItemEnd(OverListType t)
+    : m_list_type(t)
+{
+}
+
+std::string PodNodeItemEnd::ToHTML() const
+{
+    return item_end_html(m_list_type);
+}
+
+PodNodeBack::PodNodeBack(OverListType t)
+    : m_list_type(t)
+{
+}
+
+std::string PodNodeBack::ToHTML() const
+{
+    return back_html(m_list_type);
+}
+
+std::string PodNodeParaStart::ToHTML() const
+{
+    return "<p>";
+}
+
+std::string PodNodeParaEnd::ToHTML() const
+{
+    return "</p>\n";
+}
+
+PodNodeInlineText::PodNodeInlineText(std::string text)
+    : m_text(text)
+{
+}
+
+PodNodeInlineText::PodNodeInlineText(PodText text)
+    : m_text(text)
+{
+}
+
+PodNodeInlineText::PodNodeInlineText(char ch)
+    : m_text(std::string(1, ch))
+{
+}
+
+void PodNodeInlineText::AddText(const std::string& text) {
+    m_text.Append(text);
+}
+
+void PodNodeInlineText::AddText(char ch) {
+    m_text.Append(std::string(1, ch));
+}
+
+void PodNodeInlineText::StripTrailingWhitespace() {
+    PodStringRef text = m_text.Ref();
+    size_t length = text.Size();
+    while (length > 0 && text[length-1] == ' ')
+        length--;
+
+    m_text.Truncate(length);
+}
+
+std::string PodNodeInlineText::ToHTML() const
+{
+    return m_text.ToString();
+}
+
+PodNodeInlineMarkupStart::PodNodeInlineMarkupStart(mtype type, std::initializer_list<std::string> args)
+    : m_mtype(type),
+      mp_arg(nullptr)
+{
+    if (args.size() > 0)
+        argument().value = *args.begin();
+}
+
+PodNodeInlineMarkupStart::~PodNodeInlineMarkupStart()
+{
+    delete mp_arg;
+}
+
+// Returns the argument record, creating it if necessary.
+PodMarkupArgument& PodNodeInlineMarkupStart::argument()
+{
+    if (!mp_arg)
+        mp_arg = new PodMarkupArgument();
+
+    return *mp_arg;
+}
+
+// If for whatever reason the PodNodeInlineMarkupStart cannot be constructed
+// directly with the argument list, use this function to inject the argument
+// later on. Only the first non-empty argument is used.
+void PodNodeInlineMarkupStart::AddArgument(const std::string& arg)
+{
+    if (argument().value.empty())
+        mp_arg->value = arg;
+}
+
+// Set the filename calculation callback used for calculating L<> internal
+// link targets.
+void PodNodeInlineMarkupStart::SetFilenameCallback(std::string (*cb)(std::string))
+{
+    argument().filename_cb = cb;
+}
+
+// Set the method name ID calculation callback used for calculating L<> internal
+// link targets.
+void PodNodeInlineMarkupStart::SetMethodnameCallback(std::string (*cb)(bool, std::string))
+{
+    argument().mname_cb = cb;
+}
+
+std::string PodNodeInlineMarkupStart::ToHTML() const
+{
+    if (m_mtype == mtype::link) {
+        if (mp_arg)
+            return link_start_html(mp_arg->value, mp_arg->filename_cb, mp_arg->mname_cb);
+        else
+            return link_start_html("", nullptr, nullptr);
+    }
+    else
+        return markup_start_html(m_mtype);
+}
+
+PodNodeInlineMarkupEnd::PodNodeInlineMarkupEnd(mtype type, std::initializer_list<std::string> args)
+    : m_mtype(type),
+      mp_arg(nullptr)
+{
+    if (args.size() > 0) {
+        mp_arg = new PodMarkupArgument();
+        mp_arg->value = *args.begin();
+    }
+}
+
+PodNodeInlineMarkupEnd::~PodNodeInlineMarkupEnd()
+{
+    delete mp_arg;
+}
+
+std::string PodNodeInlineMarkupEnd::ToHTML() const
+{
+    std::string arg = mp_arg ? mp_arg->value : std::string();
+
+    switch (m_mtype) {
+    case mtype::escape:
+        return escape_html(arg);
+    case mtype::index:
+        return index_html(arg);
+    default:
+        return markup_end_html(m_mtype);
+    }
+}
+
+PodNodeData::PodNodeData(std::string data, std::vector<std::string> arguments)
+    : m_data(data),
+      m_arguments(arguments)
+{
+}
+
+PodNodeData::PodNodeData(PodText data, std::vector<std::string> arguments)
+    : m_data(data),
+      m_arguments(arguments)
+{
+}
+
+std::string PodNodeData::ToHTML() const
+{
+    std::string result;
+    AppendHTML(result);
+    return result;
+}
+
+void PodNodeData::AppendHTML(std::string& result) const
+{
+    append_data_html(result, m_arguments.empty() ? PodStringRef() : PodStringRef(m_arguments[0]), m_data.Ref());
+}
+
+PodNodeVerbatim::PodNodeVerbatim(std::string text)
+    : m_text(text),
+      m_indent(0)
+{
+}
+
+PodNodeVerbatim::PodNodeVerbatim(PodText text, size_t indent)
+    : m_text(text),
+      m_indent(indent)
+{
+}
+
+void PodNodeVerbatim::AddText(std::string text)
+{
+    if (m_indent > 0) { // `text' is not indented, so strip the own text first
+        std::string unindented;
+        append_unindented(unindented, m_text.Ref(), m_indent);
+        m_text = PodText(unindented);
+        m_indent = 0;
+    }
+
+    m_text.Append(text);
+}
+
+std::string PodNodeVerbatim::ToHTML() const
+{
+    std::string result;
+    AppendHTML(result);
+    return result;
+}
+
+void PodNodeVerbatim::AppendHTML(std::string& result) const
+{
+    append_verbatim_html(result, m_text.Ref(), m_indent);
+}
+
+/***************************************
+ * Token stream
+ **************************************/
+
+PodTokenStream::PodTokenStream()
+    : m_filename_cb(nullptr),
+      m_mname_cb(nullptr)
+{
+}
+
+// Returns the arguments of the =begin command (or =for) of data
+// token `i'.
+const std::vector<std::string>& PodTokenStream::GetDataArguments(size_t i) const
+{
+    auto iter = std::lower_bound(m_data_tokens.begin(), m_data_tokens.end(), i);
+    if (iter == m_data_tokens.end() || *iter != i)
+        throw(std::out_of_range("Token is not a data token"));
+
+    return m_data_args[iter - m_data_tokens.begin()];
+}
+
+// Returns the format name of data token `i', i.e. the first
+// argument of its =begin (or =for) command.
+PodStringRef PodTokenStream::GetDataFormat(size_t i) const
+{
+    const std::vector<std::string>& arguments = GetDataArguments(i);
+    return arguments.empty() ? PodStringRef() : PodStringRef(arguments[0]);
+}
+
+// Returns the text of verbatim token `i' with its indentation removed.
+std::string PodTokenStream::GetVerbatimText(size_t i) const
+{
+    std::string result;
+    append_unindented(result, GetPayload(i), GetFlags(i));
+    return result;
+}
+
+PodNode* PodTokenStream::MakeNode(size_t i) const
+{
+    PodNodeInlineMarkupStart* p_mstart = nullptr;
+    // Only the source is immutable; the arena may still grow.
+    PodText text = IsBorrowed(i) ? PodText::Borrow(GetPayload(i)) : PodText(GetPayload(i).ToString());
+
+    switch (m_types[i]) {
+    case ntype::head_start:
+        return new PodNodeHeadStart(GetLevel(i), GetPayload(i).ToString());
+    case ntype::head_end:
+        return new PodNodeHeadEnd(GetLevel(i));
+    case ntype::over: {
+        PodNodeOver* p_over = new PodNodeOver(m_lengths[i] > 0 ? std::stof(GetPayload(i).ToString()) : 4.0f);
+        p_over->SetListType(GetListType(i));
+        return p_over; }
+    case ntype::item_start:
+        return new PodNodeItemStart(GetPayload(i).ToString());
+    case ntype::item_end:
+        return new PodNodeItemEnd(GetListType(i));
+    case ntype::back:
+        return new PodNodeBack(GetListType(i));
+    case ntype::para_start:
+        return new PodNodeParaStart();
+    case ntype::para_end:
+        return new PodNodeParaEnd();
+    case ntype::markup_start:
+        p_mstart = new PodNodeInlineMarkupStart(GetMtype(i));
+        if (GetMtype(i) == mtype::link) {
+            p_mstart->AddArgument(GetPayload(i).ToString());
+            p_mstart->SetFilenameCallback(m_filename_cb);
+            p_mstart->SetMethodnameCallback(m_mname_cb);
+        }
+        return p_mstart;
+    case ntype::markup_end:
+        if (GetMtype(i) == mtype::escape || GetMtype(i) == mtype::index)
+            return new PodNodeInlineMarkupEnd(GetMtype(i), {GetPayload(i).ToString()});
+        else
+            return new PodNodeInlineMarkupEnd(GetMtype(i));
+    case ntype::text:
+        return new PodNodeInlineText(text);
+    case ntype::data:
+        return new PodNodeData(text, GetDataArguments(i));
+    case ntype::verbatim:
+        return new PodNodeVerbatim(text, GetFlags(i));
+    } // No default -- all ntype values are handled
+
+    throw(std::runtime_error("This should never be reached"));
+}
+
+// Empties the stream, keeping buffers of up to `retained_capacity'
+// bytes for reuse.
+void PodTokenStream::clear(size_t retained_capacity)
+{
+    clear_retaining(m_types, retained_capacity);
+    clear_retaining(m_flags, retained_capacity);
+    clear_retaining(m_offsets, retained_capacity);
+    clear_retaining(m_lengths, retained_capacity);
+    clear_retaining(m_arena, retained_capacity);
+    clear_retaining(m_source, retained_capacity);
+    m_data_tokens.clear();
+    m_data_args.clear();
+}
+
+// Appends a token and returns its index. If `payload' was taken
+// unchanged from the source at `source_offset', it is not copied.
+size_t PodTokenStream::add(ntype t, unsigned char flags, const std::string& payload, size_t source_offset)
+{
+    m_types.push_back(t);
+    if (borrowable(payload, source_offset)) {
+        m_flags.push_back(flags | borrowed_flag);
+        m_offsets.push_back(source_offset);
+    }
+    else {
+        m_flags.push_back(flags);
+        m_offsets.push_back(m_arena.length());
+        m_arena += payload;
+    }
+    m_lengths.push_back(payload.length());
+
+    return m_types.size() - 1;
+}
+
+// Appends a token whose payload is the `length' bytes of the source
+// at `source_offset', and returns its index.
+size_t PodTokenStream::add_borrowed(ntype t, unsigned char flags, size_t source_offset, size_t length)
+{
+    m_types.push_back(t);
+    m_flags.push_back(flags | borrowed_flag);
+    m_offsets.push_back(source_offset);
+    m_lengths.push_back(length);
+
+    return m_types.size() - 1;
+}
+
+void PodTokenStream::set_payload(size_t i, const std::string& payload)
+{
+    m_flags[i] &= ~borrowed_flag;
+    m_offsets[i] = m_arena.length();
+    m_lengths[i] = payload.length();
+    m_arena += payload;
+}
+
+// Extends the payload of token `i' by `text'. A borrowed payload
+// stays borrowed as long as `text' continues it in the source,
+// otherwise it is copied into the arena. This is cheap if the payload
+// is the last one in the arena (which it is when text is being
+// accumulated), otherwise the payload is moved to the end first.
+void PodTokenStream::append_payload(size_t i, const std::string& text, size_t source_offset)
+{
+    if (IsBorrowed(i)) {
+        if (source_offset == m_offsets[i] + m_lengths[i] && borrowable(text, source_offset)) {
+            m_lengths[i] += text.length();
+            return;
+        }
+        make_owned(i);
+    }
+    else if (m_offsets[i] + m_lengths[i] != m_arena.length()) {
+        size_t offset = m_arena.length();
+        m_arena.append(m_arena, m_offsets[i], m_lengths[i]);
+        m_offsets[i] = offset;
+    }
+
+    m_arena += text;
+    m_lengths[i] += text.length();
+}
+
+void PodTokenStream::truncate_payload(size_t i, size_t length)
+{
+    if (!IsBorrowed(i) && m_offsets[i] + m_lengths[i] == m_arena.length())
+        m_arena.resize(m_offsets[i] + length);
+
+    m_lengths[i] = length;
+}
+
+// Checks whether `text' is what the source contains at `source_offset'.
+bool PodTokenStream::borrowable(const std::string& text, size_t source_offset) const
+{
+    return source_offset != std::string::npos
+        && source_offset <= m_source.length()
+        && m_source.compare(source_offset, text.length(), text) == 0;
+}
+
+// Copies the borrowed payload of token `i' to the end of the arena.
+void PodTokenStream::make_owned(size_t i)
+{
+    size_t offset = m_arena.length();
+    m_arena.append(m_source, m_offsets[i], m_lengths[i]);
+    m_flags[i] &= ~borrowed_flag;
+    m_offsets[i] = offset;
+}
+
+void PodTokenStream::add_data_arguments(size_t i, const std::vector<std::string>& arguments)
+{
+    m_data_tokens.push_back(i);
+    m_data_args.push_back(arguments);
+}
+
+// Appends a copy of token `i' of `other', which must have the same
+// source, and returns its index.
+size_t PodTokenStream::add_copy(const PodTokenStream& other, size_t i)
+{
+    m_types.push_back(other.m_types[i]);
+    m_flags.push_back(other.m_flags[i]);
+    if (other.IsBorrowed(i))
+        m_offsets.push_back(other.m_offsets[i]);
+    else {
+        m_offsets.push_back(m_arena.length());
+        m_arena.append(other.m_arena, other.m_offsets[i], other.m_lengths[i]);
+    }
+    m_lengths.push_back(other.m_lengths[i]);
+    if (other.m_types[i] == ntype::data)
+        add_data_arguments(m_types.size() - 1, other.GetDataArguments(i));
+
+    return m_types.size() - 1;
+}
+
+// Moves token `from' to index `to', overwriting what is there.
+// Data tokens must not be moved.
+void PodTokenStream::move(size_t from, size_t to)
+{
+    if (from == to)
+        return;
+
+    m_types[to]   = m_types[from];
+    m_flags[to]   = m_flags[from];
+    m_offsets[to] = m_offsets[from];
+    m_lengths[to] = m_lengths[from];
+}
+
+// Removes the tokens in the range [first, last). Data tokens must
+// not be erased. The arena is not compacted.
+void PodTokenStream::erase(size_t first, size_t last)
+{
+    m_types.erase(m_types.begin() + first, m_types.begin() + last);
+    m_flags.erase(m_flags.begin() + first, m_flags.begin() + last);
+    m_offsets.erase(m_offsets.begin() + first, m_offsets.begin() + last);
+    m_lengths.erase(m_lengths.begin() + first, m_lengths.begin() + last);
+}
+
+/***************************************
+ * Serialized token streams
+ **************************************/
+
+/* Layout of a serialized token stream. All numbers are uint32_t in
+ * host byte order; the byte order mark tells whether the reader
+ * agrees. All offsets are relative, so the blob may be loaded at
+ * any address.
+ *
+ *   Header:     "PODT", version, byte order mark, token count, data
+ *               token count, data argument count, index entry count,
+ *               text size
+ *   Tokens:     types and flags (one byte each per token), padded
+ *               to 4 bytes, then payload offsets and payload lengths
+ *   Data:       token index, first argument, argument count per data
+ *               token, sorted by token index
+ *   Arguments:  text offset and length per data argument
+ *   Index:      keyword offset and length, target offset and length
+ *               per index entry, sorted by keyword
+ *   Text:       all payloads, arguments and index entries */
+
+static const char s_blob_magic[4] = {'P', 'O', 'D', 'T'};
+static const uint32_t s_blob_bom = 0x01020304;
+static const size_t s_blob_header_words = 8;
+
+const uint32_t PodTokenView::version;
+
+static inline size_t align4(size_t n)
+{
+    return (n + 3) & ~static_cast<size_t>(3);
+}
+
+static void append_u32(std::string& blob, uint32_t value)
+{
+    blob.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Appends `str' to `text' and its location to `refs'.
+static void append_text_ref(std::string& refs, std::string& text, PodStringRef str)
+{
+    append_u32(refs, text.length());
+    append_u32(refs, str.Size());
+    text.append(str.Data(), str.Size());
+}
+
+/**
+ * Serializes the parsed token stream and the index entries into a
+ * binary blob that can be stored away and later be used in place
+ * with PodTokenView, without parsing the document again.
+ */
+std::string PodParser::Serialize() const
+{
+    if (!m_pending.empty())
+        throw(std::logic_error("Paragraphs are not parsed yet, see PodParser::ParseInline()"));
+
+    size_t count = m_stream.Size();
+    std::string types(count, '\0');
+    std::string flags(count, '\0');
+    std::string offsets;
+    std::string lengths;
+    std::string data;
+    std::string args;
+    std::string index;
+    std::string text;
+    size_t arg_count = 0;
+
+    for (size_t i=0; i < count; i++) {
+        types[i] = static_cast<char>(m_stream.GetNtype(i));
+        flags[i] = static_cast<char>(m_stream.GetFlags(i));
+        PodStringRef payload = m_stream.GetPayload(i);
+        append_u32(offsets, text.length());
+        append_u32(lengths, payload.Size());
+        text.append(payload.Data(), payload.Size());
+    }
+
+    for (size_t n=0; n < m_stream.m_data_tokens.size(); n++) {
+        const std::vector<std::string>& arguments = m_stream.m_data_args[n];
+        append_u32(data, m_stream.m_data_tokens[n]);
+        append_u32(data, arg_count);
+        append_u32(data, arguments.size());
+        for (const std::string& arg: arguments) {
+            append_text_ref(args, text, arg);
+        }
+        arg_count += arguments.size();
+    }
+
+    for (const auto& entry: m_idx_keywords) {
+        append_text_ref(index, text, entry.first);
+        append_text_ref(index, text, entry.second);
+    }
+
+    std::string blob(s_blob_magic, sizeof(s_blob_magic));
+    append_u32(blob, PodTokenView::version);
+    append_u32(blob, s_blob_bom);
+    append_u32(blob, count);
+    append_u32(blob, m_stream.m_data_tokens.size());
+    append_u32(blob, arg_count);
+    append_u32(blob, m_idx_keywords.size());
+    append_u32(blob, text.length());
+    blob += types;
+    blob += flags;
+    blob.resize(align4(blob.length()), '\0');
+    blob += offsets;
+    blob += lengths;
+    blob += data;
+    blob += args;
+    blob += index;
+    blob += text;
+
+    return blob;
+}
+
+// Whether `flags' is a valid flags byte for a token of type `t':
+// a heading level, a list type or a formatting code.
+static bool valid_flags(ntype t, unsigned char flags)
+{
+    switch (t) {
+    case ntype::head_start: // fall-through
+    case ntype::head_end:
+        return flags >= 1 && flags <= 4;
+    case ntype::over:       // fall-through
+    case ntype::item_start: // fall-through
+    case ntype::item_end:   // fall-through
+    case ntype::back:
+        return flags <= static_cast<unsigned char>(OverListType::description);
+    case ntype::markup_start: // fall-through
+    case ntype::markup_end:
+        return flags <= static_cast<unsigned char>(mtype::link);
+    default:
+        return true;
+    }
+}
+
+/**
+ * Maps a view onto the serialized token stream of `size' bytes at
+ * `p_blob'. The blob is checked to be consistent, so that none of
+ * the accessors can read outside of it, but not copied.
+ */
+PodTokenView::PodTokenView(const void* p_blob, size_t size)
+{
+    const char* p_bytes = static_cast<const char*>(p_blob);
+    const uint32_t* p_header = static_cast<const uint32_t*>(p_blob);
+
+    if (reinterpret_cast<uintptr_t>(p_blob) % 4 != 0)
+        throw(std::runtime_error("Serialized token stream is not aligned"));
+    if (size < s_blob_header_words * 4 || memcmp(p_bytes, s_blob_magic, sizeof(s_blob_magic)) != 0)
+        throw(std::runtime_error("Not a serialized token stream"));
+    if (p_header[1] != version)
+        throw(std::runtime_error("Unsupported serialized token stream version " + std::to_string(p_header[1])));
+    if (p_header[2] != s_blob_bom)
+        throw(std::runtime_error("Serialized token stream has foreign byte order"));
+
+    m_count = p_header[3];
+    m_data_count = p_header[4];
+    size_t arg_count = p_header[5];
+    m_index_count = p_header[6];
+    size_t text_size = p_header[7];
+
+    // Compute the layout in 64 bits, so that bogus counts cannot
+    // overflow it.
+    uint64_t pos = s_blob_header_words * 4;
+    uint64_t types_pos = pos;
+    pos += 2 * static_cast<uint64_t>(m_count);
+    pos = (pos + 3) & ~static_cast<uint64_t>(3);
+    uint64_t offsets_pos = pos;
+    pos += 8 * static_cast<uint64_t>(m_count);
+    uint64_t data_pos = pos;
+    pos += 12 * static_cast<uint64_t>(m_data_count);
+    uint64_t args_pos = pos;
+    pos += 8 * static_cast<uint64_t>(arg_count);
+    uint64_t index_pos = pos;
+    pos += 16 * static_cast<uint64_t>(m_index_count);
+    uint64_t text_pos = pos;
+    pos += text_size;
+    if (pos > size)
+        throw(std::runtime_error("Serialized token stream is truncated"));
+
+    mp_types   = reinterpret_cast<const unsigned char*>(p_bytes + types_pos);
+    mp_flags   = mp_types + m_count;
+    mp_offsets = reinterpret_cast<const uint32_t*>(p_bytes + offsets_pos);
+    mp_lengths = mp_offsets + m_count;
+    mp_data    = reinterpret_cast<const uint32_t*>(p_bytes + data_pos);
+    mp_args    = reinterpret_cast<const uint32_t*>(p_bytes + args_pos);
+    mp_index   = reinterpret_cast<const uint32_t*>(p_bytes + index_pos);
+    mp_text    = p_bytes + text_pos;
+
+    for (size_t i=0; i < m_count; i++) {
+        if (mp_types[i] > static_cast<unsigned char>(ntype::verbatim)
+            || !valid_flags(static_cast<ntype>(mp_types[i]), mp_flags[i])
+            || static_cast<uint64_t>(mp_offsets[i]) + mp_lengths[i] > text_size)
+            throw(std::runtime_error("Serialized token stream has invalid token " + std::to_string(i)));
+    }
+    for (size_t n=0; n < m_data_count; n++) {
+        const uint32_t* p_data = mp_data + 3*n;
+        if (p_data[0] >= m_count || (n > 0 && p_data[0] <= p_data[-3])
+            || mp_types[p_data[0]] != static_cast<unsigned char>(ntype::data)
+            || static_cast<uint64_t>(p_data[1]) + p_data[2] > arg_count)
+            throw(std::runtime_error("Serialized token stream has invalid data token " + std::to_string(n)));
+    }
+    // Each data token has its entry in the table
+    if (static_cast<size_t>(std::count(mp_types, mp_types + m_count, static_cast<unsigned char>(ntype::data))) != m_data_count)
+        throw(std::runtime_error("Serialized token stream has data tokens without arguments"));
+    // Argument and index text references are contiguous
+    for (const uint32_t* p_ref=mp_args; p_ref < mp_index + 4*m_index_count; p_ref += 2) {
+        if (static_cast<uint64_t>(p_ref[0]) + p_ref[1] > text_size)
+            throw(std::runtime_error("Serialized token stream has invalid text reference"));
+    }
+}
+
+// Returns the data table entry of data token `i'.
+const uint32_t* PodTokenView::find_data_token(size_t i) const
+{
+    size_t first = 0;
+    size_t last = m_data_count;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (mp_data[3*middle] < i)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+
+    if (first == m_data_count || mp_data[3*first] != i)
+        throw(std::out_of_range("Token is not a data token"));
+
+    return mp_data + 3*first;
+}
+
+size_t PodTokenView::GetDataArgumentCount(size_t i) const
+{
+    return find_data_token(i)[2];
+}
+
+// Returns the `n'th argument of the =begin (or =for) command of
+// data token `i'.
+PodStringRef PodTokenView::GetDataArgument(size_t i, size_t n) const
+{
+    const uint32_t* p_data = find_data_token(i);
+    if (n >= p_data[2])
+        throw(std::out_of_range("No such data argument"));
+
+    return text_ref(mp_args + 2*(p_data[1] + n));
+}
+
+PodStringRef PodTokenView::GetDataFormat(size_t i) const
+{
+    return GetDataArgumentCount(i) > 0 ? GetDataArgument(i, 0) : PodStringRef();
+}
+
+std::string PodTokenView::GetVerbatimText(size_t i) const
+{
+    std::string result;
+    append_unindented(result, GetPayload(i), GetFlags(i));
+    return result;
+}
+
+/***************************************
+ * Formatter
+ **************************************/
+
+std::string Pod::FormatHTML(const std::vector<PodNode*>& tokens)
+{
+    std::string result;
+
+    for (const PodNode* p_node: tokens) {
+        p_node->AppendHTML(result);
+    }
+
+    return result;
+}
+
+// Parts smaller than this, in bytes of payload, are not worth a
+// thread of their own.
+static const size_t s_min_parallel_part = 256 * 1024;
+
+/* Renders the tokens [0, count) in parts on up to `jobs' threads and
+ * returns the concatenated output. `render(first, last, result)'
+ * renders tokens [first, last) to `result'. The parts are of about
+ * equal `weight(i)' each and start where `is_boundary(i)' allows. */
+template<typename Weight, typename IsBoundary, typename RenderRange>
+static std::string render_in_parts(size_t count, unsigned int jobs, Weight weight, IsBoundary is_boundary, RenderRange render)
+{
+    size_t total = 0;
+    for (size_t i=0; i < count; i++) {
+        total += weight(i);
+    }
+    if (jobs == 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    size_t parts = std::min<size_t>(jobs, total / s_min_parallel_part);
+
+    std::vector<size_t> starts(1, 0);
+    size_t sum = 0;
+    for (size_t i=0; i < count && starts.size() < parts; i++) {
+        if (sum >= total / parts * starts.size() && is_boundary(i))
+            starts.push_back(i);
+        sum += weight(i);
+    }
+    starts.push_back(count);
+
+    // Exceptions are passed on to the caller once all threads are done
+    std::vector<std::string> results(starts.size() - 1);
+    std::vector<std::exception_ptr> errors(results.size());
+    auto render_part = [&](size_t n) {
+        try {
+            render(starts[n], starts[n+1], results[n]);
+        }
+        catch (...) {
+            errors[n] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t n=1; n < results.size(); n++) {
+        threads.push_back(std::thread(render_part, n));
+    }
+    render_part(0);
+    for (std::thread& thread: threads) {
+        thread.join();
+    }
+    for (const std::exception_ptr& error: errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    size_t size = 0;
+    for (const std::string& result: results) {
+        size += result.length();
+    }
+    std::string& result = results[0];
+    result.reserve(size);
+    for (size_t n=1; n < results.size(); n++) {
+        result += results[n];
+    }
+    return std::move(result);
+}
+
+std::string Pod::FormatHTMLParallel(const std::vector<PodNode*>& tokens, unsigned int jobs)
+{
+    // Nodes do not tell their size; all count the same.
+    return render_in_parts(tokens.size(), jobs,
+                           [](size_t) { return size_t(64); },
+                           [&](size_t i) {
+                               return dynamic_cast<const PodNodeHeadStart*>(tokens[i]) != nullptr
+                                   || (i > 0 && dynamic_cast<const PodNodeParaEnd*>(tokens[i-1]) != nullptr);
+                           },
+                           [&](size_t first, size_t last, std::string& result) {
+                               for (size_t i=first; i < last; i++) {
+                                   tokens[i]->AppendHTML(result);
+                               }
+                           });
+}
+
+PodHTMLRenderer::PodHTMLRenderer(std::string (*fcb)(std::string), std::string (*mcb)(bool, std::string))
+    : m_filename_cb(fcb),
+      m_mname_cb(mcb),
+      m_fragment_threshold(0),
+      m_output(output::string),
+      mp_buffer(nullptr),
+      m_size(0)
+{
+}
+
+/**
+ * Only counts the bytes of the output instead of producing it; see
+ * GetSize(). This is exact, so that a buffer of that size can be
+ * handed to SetOutputBuffer() for rendering the same tokens again.
+ */
+void PodHTMLRenderer::SetMeasuring()
+{
+    m_output = output::measure;
+    m_size = 0;
+}
+
+/**
+ * Writes the output to `p_buffer' instead of the result. The buffer
+ * must be large enough, e.g. as large as a measuring pass found.
+ */
+void PodHTMLRenderer::SetOutputBuffer(char* p_buffer)
+{
+    m_output = output::buffer;
+    mp_buffer = p_buffer;
+    m_size = 0;
+}
+
+/// The number of bytes of output so far, in any of the modes.
+size_t PodHTMLRenderer::GetSize() const
+{
+    return m_output == output::string ? m_result.length() : m_size;
+}
+
+inline void PodHTMLRenderer::put(const char* p_text, size_t size)
+{
+    switch (m_output) {
+    case output::string:
+        m_result.append(p_text, size);
+        break;
+    case output::buffer:
+        memcpy(mp_buffer + m_size, p_text, size);
+        m_size += size;
+        break;
+    case output::measure:
+        m_size += size;
+        break;
+    }
+}
+
+inline void PodHTMLRenderer::put(const char* p_text)
+{
+    put(p_text, strlen(p_text));
+}
+
+inline void PodHTMLRenderer::put(const std::string& text)
+{
+    put(text.data(), text.length());
+}
+
+// Appends `text' to the output, or refers to it if it is large
+// enough to be worth an extra fragment.
+void PodHTMLRenderer::add_payload(PodStringRef text)
+{
+    if (m_fragment_threshold > 0 && text.Size() >= m_fragment_threshold && m_output == output::string)
+        m_references.push_back(std::make_pair(m_result.length(), text));
+    else
+        put(text.Data(), text.Size());
+}
+
+/**
+ * Returns the output as a list of pieces, which are, in order, the
+ * result up to the first payload referred to, that payload, the
+ * result up to the next one, and so on. Without a fragment threshold,
+ * this is just the result.
+ */
+std::vector<PodStringRef> PodHTMLRenderer::GetFragments() const
+{
+    std::vector<PodStringRef> fragments;
+    fragments.reserve(2 * m_references.size() + 1);
+
+    size_t start = 0;
+    for (const auto& reference: m_references) {
+        if (reference.first > start)
+            fragments.push_back(PodStringRef(m_result.data() + start, reference.first - start));
+        fragments.push_back(reference.second);
+        start = reference.first;
+    }
+    if (m_result.length() > start)
+        fragments.push_back(PodStringRef(m_result.data() + start, m_result.length() - start));
+
+    return fragments;
+}
+
+void PodHTMLRenderer::HeadStart(int level, PodStringRef anchor)
+{
+    put(head_start_html(level, anchor.ToString()));
+}
+
+void PodHTMLRenderer::HeadEnd(int level)
+{
+    put(head_end_html(level));
+}
+
+void PodHTMLRenderer::Over(OverListType t, PodStringRef)
+{
+    put(over_html(t));
+}
+
+void PodHTMLRenderer::ItemStart(OverListType t, PodStringRef label)
+{
+    put(item_start_html(t, label.ToString()));
+}
+
+void PodHTMLRenderer::ItemEnd(OverListType t)
+{
+    put(item_end_html(t));
+}
+
+void PodHTMLRenderer::Back(OverListType t)
+{
+    put(back_html(t));
+}
+
+void PodHTMLRenderer::ParaStart()
+{
+    put("<p>", 3);
+}
+
+void PodHTMLRenderer::ParaEnd()
+{
+    put("</p>\n", 5);
+}
+
+void PodHTMLRenderer::MarkupStart(mtype t, PodStringRef link)
+{
+    if (t == mtype::link)
+        put(link_start_html(link.ToString(), m_filename_cb, m_mname_cb));
+    else
+        put(markup_start_html(t));
+}
+
+void PodHTMLRenderer::MarkupEnd(mtype t, PodStringRef arg)
+{
+    if (t == mtype::escape)
+        put(escape_html(arg.ToString()));
+    else if (t == mtype::index)
+        put(index_html(arg.ToString()));
+    else
+        put(markup_end_html(t));
+}
+
+void PodHTMLRenderer::Text(PodStringRef text)
+{
+    add_payload(text);
+}
+
+void PodHTMLRenderer::Data(PodStringRef format, PodStringRef data)
+{
+    if (format.Size() == 4 && memcmp(format.Data(), "html", 4) == 0)
+        add_payload(data);
+}
+
+// Like append_verbatim_html(), but line by line, so that long lines
+// can still be referred to.
+void PodHTMLRenderer::Verbatim(PodStringRef text, size_t indent)
+{
+    if (m_output == output::string && m_fragment_threshold == 0) {
+        append_verbatim_html(m_result, text, indent);
+        return;
+    }
+
+    put("<pre>", 5);
+    if (indent == 0)
+        add_payload(text);
+    else {
+        size_t start = 0;
+        while (start < text.Size()) {
+            const char* p_eol = static_cast<const char*>(memchr(text.Data() + start, '\n', text.Size() - start));
+            size_t end = p_eol ? p_eol - text.Data() + 1 : text.Size();
+            PodStringRef line(text.Data() + start, end - start);
+            size_t skip = std::min(indent, count_leading_whitespace(line));
+
+            add_payload(PodStringRef(line.Data() + skip, line.Size() - skip));
+            start = end;
+        }
+    }
+    put("</pre>\n", 7);
+}
+
+// A measuring pass costs about as much as rendering does for
+// documents with many links and headings, so the result is only
+// reserved at an estimate. The HTML is rarely much longer than
+// the POD it is made from.
+std::string Pod::FormatHTML(const PodTokenStream& stream)
+{
+    PodHTMLRenderer renderer(stream.GetFilenameCallback(), stream.GetMethodnameCallback());
+    renderer.GetResult().reserve(stream.GetSource().length() + stream.GetSource().length() / 4);
+    renderer.Render(stream);
+    return std::move(renderer.GetResult());
+}
+
+std::string Pod::FormatHTMLParallel(const PodTokenStream& stream, unsigned int jobs)
+{
+    // Each token is some markup and its payload
+    auto weight = [&](size_t i) { return stream.GetPayload(i).Size() + 16; };
+    return render_in_parts(stream.Size(), jobs, weight,
+                           [&](size_t i) {
+                               return stream.GetNtype(i) == ntype::head_start
+                                   || (i > 0 && stream.GetNtype(i-1) == ntype::para_end);
+                           },
+                           [&](size_t first, size_t last, std::string& result) {
+                               size_t size = 0;
+                               for (size_t i=first; i < last; i++) {
+                                   size += weight(i);
+                               }
+
+                               PodHTMLRenderer renderer(stream.GetFilenameCallback(), stream.GetMethodnameCallback());
+                               renderer.GetResult().reserve(size + size / 4);
+                               renderer.Render(stream, first, last);
+                               result = std::move(renderer.GetResult());
+                           });
+}
+
+std::string Pod::FormatHTML(const PodTokenView& view,
+                            std::string (*fcb)(std::string),
+                            std::string (*mcb)(bool, std::string))
+{
+    PodHTMLRenderer renderer(fcb, mcb);
+    renderer.Render(view);
+    return std::move(renderer.GetResult());
+}
+
+size_t Pod::MeasureHTML(const PodTokenStream& stream)
+{
+    PodHTMLRenderer renderer(stream.GetFilenameCallback(), stream.GetMethodnameCallback());
+    renderer.SetMeasuring();
+    renderer.Render(stream);
+    return renderer.GetSize();
+}
+
+char* Pod::FormatHTML(const PodTokenStream& stream, char* p_buffer)
+{
+    PodHTMLRenderer renderer(stream.GetFilenameCallback(), stream.GetMethodnameCallback());
+    renderer.SetOutputBuffer(p_buffer);
+    renderer.Render(stream);
+    return p_buffer + renderer.GetSize();
+}
+
+std::string Pod::FormatText(const PodTokenStream& stream)
+{
+    PodTextRenderer renderer;
+    renderer.Render(stream);
+    return std::move(renderer.GetResult());
+}
+
+std::string Pod::FormatMarkdown(const PodTokenStream& stream)
+{
+    PodMarkdownRenderer renderer(stream.GetFilenameCallback(), stream.GetMethodnameCallback());
+    renderer.Render(stream);
+    return std::move(renderer.GetResult());
+}
+
+std::string Pod::FormatRoff(const PodTokenStream& stream)
+{
+    PodRoffRenderer renderer;
+    renderer.Render(stream);
+    return std::move(renderer.GetResult());
+}
+
+std::string Pod::FormatTOC(const std::vector<PodHeading>& outline)
+{
+    std::string result;
+    std::vector<size_t> open; // The current heading and its ancestors
+
+    for (size_t i=0; i < outline.size(); i++) {
+        size_t parent = outline[i].parent;
+
+        // Close the items up to the parent, and the lists of those
+        // which are not siblings of this heading.
+        while (!open.empty() && open.back() != parent) {
+            size_t closed = open.back();
+            open.pop_back();
+            result += "</li>\n";
+            if (outline[closed].parent != parent)
+                result += "</ul>\n";
+        }
+
+        // The first child of a heading directly follows it
+        if (i == 0)
+            result += "<ul class=\"toc\">\n";
+        else if (parent == i - 1)
+            result += "\n<ul>\n";
+
+        std::string text(outline[i].text);
+        html_escape(text);
+        result += "<li><a href=\"#" + outline[i].anchor + "\">" + text + "</a>";
+        open.push_back(i);
+    }
+
+    while (!open.empty()) {
+        open.pop_back();
+        result += "</li>\n</ul>\n";
+    }
+
+    return result;
+}
+
+/***************************************
+ * Text, Markdown and roff output
+ **************************************/
+
+// `text' without leading and trailing spaces.
+static std::string strip_spaces(const std::string& text)
+{
+    size_t start = text.find_first_not_of(' ');
+    if (start == std::string::npos)
+        return std::string();
+    return text.substr(start, text.find_last_not_of(' ') - start + 1);
+}
+
+// Number of characters in the UTF-8 string `text'.
+static size_t utf8_length(const std::string& text)
+{
+    size_t length = 0;
+    for (char ch: text) {
+        if ((static_cast<unsigned char>(ch) & 0xC0) != 0x80)
+            length++;
+    }
+    return length;
+}
+
+// The label of a description list item, as shown by item_start_html().
+static std::string description_label(PodStringRef label)
+{
+    std::string result;
+    if (label.Size() >= 2)
+        append_unescaped(result, PodStringRef(label.Data() + 1, label.Size() - 2));
+    return result;
+}
+
+static const size_t s_text_width = 76;
+
+PodTextRenderer::PodTextRenderer()
+{
+}
+
+void PodTextRenderer::HeadEnd(int level)
+{
+    std::string title = strip_spaces(m_inline);
+    m_inline.clear();
+
+    m_result += title + "\n";
+    if (level <= 2)
+        m_result += std::string(utf8_length(title), level == 1 ? '=' : '-') + "\n";
+    m_result += "\n";
+}
+
+void PodTextRenderer::Over(OverListType, PodStringRef)
+{
+    m_indent += "    ";
+}
+
+void PodTextRenderer::ItemStart(OverListType t, PodStringRef label)
+{
+    flush_bullet();
+    std::string parent_indent(m_indent, 0, m_indent.length() >= 4 ? m_indent.length() - 4 : 0);
+
+    if (t == OverListType::description) {
+        m_result += parent_indent + description_label(label) + "\n";
+        m_bullet.clear();
+    }
+    else {
+        std::string bullet;
+        append_unescaped(bullet, label);
+        bullet += " ";
+        if (bullet.length() < 4)
+            bullet.insert(0, 4 - bullet.length(), ' ');
+        m_bullet = parent_indent + bullet;
+    }
+}
+
+void PodTextRenderer::Back(OverListType)
+{
+    flush_bullet();
+    if (m_indent.length() >= 4)
+        m_indent.resize(m_indent.length() - 4);
+}
+
+void PodTextRenderer::ParaEnd()
+{
+    std::string text = strip_spaces(m_inline);
+    m_inline.clear();
+    if (text.empty()) // E.g. the empty paragraph after =item
+        return;
+
+    add_block(m_bullet.empty() ? m_indent : m_bullet, m_indent, text);
+    m_bullet.clear();
+}
+
+void PodTextRenderer::Text(PodStringRef text)
+{
+    append_unescaped(m_inline, text);
+}
+
+void PodTextRenderer::Data(PodStringRef format, PodStringRef data)
+{
+    if (format.Size() == 4 && memcmp(format.Data(), "text", 4) == 0) {
+        m_result.append(data.Data(), data.Size());
+        m_result += "\n";
+    }
+}
+
+void PodTextRenderer::Verbatim(PodStringRef text, size_t indent)
+{
+    if (!m_bullet.empty()) { // Bullet on a line of its own
+        m_result += m_bullet.substr(0, m_bullet.find_last_not_of(' ') + 1) + "\n";
+        m_bullet.clear();
+    }
+
+    std::string unindented;
+    append_unindented(unindented, text, indent);
+    std::istringstream lines(unindented);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (!line.empty())
+            m_result += m_indent + "    " + line;
+        m_result += "\n";
+    }
+    m_result += "\n";
+}
+
+// Emits the bullet of an =item without a paragraph on a line of its
+// own, so that the item is not lost.
+void PodTextRenderer::flush_bullet()
+{
+    if (!m_bullet.empty()) {
+        m_result += m_bullet.substr(0, m_bullet.find_last_not_of(' ') + 1) + "\n\n";
+        m_bullet.clear();
+    }
+}
+
+// Appends `text' wrapped at spaces into lines of at most
+// s_text_width characters where possible. The first line starts
+// with `first_prefix', all others with `prefix'.
+void PodTextRenderer::add_block(const std::string& first_prefix, const std::string& prefix, const std::string& text)
+{
+    std::string line(first_prefix);
+    size_t line_length = utf8_length(line);
+    bool line_empty = true;
+
+    size_t start = 0;
+    while (start < text.length()) {
+        size_t end = text.find(' ', start);
+        if (end == std::string::npos)
+            end = text.length();
+        if (end == start) { // Multiple spaces
+            start++;
+            continue;
+        }
+
+        std::string word(text, start, end - start);
+        size_t word_length = utf8_length(word);
+        if (!line_empty && line_length + 1 + word_length > s_text_width) {
+            m_result += line + "\n";
+            line = prefix;
+            line_length = utf8_length(prefix);
+            line_empty = true;
+        }
+        if (!line_empty) {
+            line += ' ';
+            line_length++;
+        }
+        line += word;
+        line_length += word_length;
+        line_empty = false;
+        start = end + 1;
+    }
+
+    m_result += line + "\n\n";
+}
+
+PodMarkdownRenderer::PodMarkdownRenderer(std::string (*fcb)(std::string), std::string (*mcb)(bool, std::string))
+    : m_code_level(0),
+      m_filename_cb(fcb),
+      m_mname_cb(mcb)
+{
+}
+
+void PodMarkdownRenderer::HeadEnd(int level)
+{
+    m_result += std::string(level, '#') + " " + strip_spaces(m_inline) + "\n\n";
+    m_inline.clear();
+}
+
+void PodMarkdownRenderer::Over(OverListType, PodStringRef)
+{
+    // The items' text is indented like the text of the enclosing item
+    m_indents.push_back(m_indents.empty() ? std::string() : m_indents.back());
+}
+
+void PodMarkdownRenderer::ItemStart(OverListType t, PodStringRef label)
+{
+    flush_bullet();
+    if (m_indents.empty()) // =item outside =over
+        m_indents.push_back(std::string());
+    std::string list_indent = m_indents.size() > 1 ? m_indents[m_indents.size() - 2] : std::string();
+
+    switch (t) {
+    case OverListType::unordered:
+        m_bullet = "-";
+        break;
+    case OverListType::ordered:
+        m_bullet.clear();
+        append_unescaped(m_bullet, label);
+        break;
+    case OverListType::description:
+        // There are no description lists, so the label becomes a
+        // paragraph of its own.
+        m_result += list_indent + "**" + description_label(label) + "**\n\n";
+        m_bullet.clear();
+        break;
+    }
+
+    m_indents.back() = list_indent + std::string(m_bullet.empty() ? 0 : m_bullet.length() + 1, ' ');
+}
+
+void PodMarkdownRenderer::Back(OverListType)
+{
+    flush_bullet();
+    if (!m_indents.empty())
+        m_indents.pop_back();
+}
+
+void PodMarkdownRenderer::ParaEnd()
+{
+    std::string text = strip_spaces(m_inline);
+    m_inline.clear();
+    if (text.empty()) // E.g. the empty paragraph after =item
+        return;
+
+    add_block(text);
+}
+
+void PodMarkdownRenderer::MarkupStart(mtype t, PodStringRef link)
+{
+    switch (t) {
+    case mtype::italic:
+    case mtype::filename: // fall-through
+        m_inline += "*";
+        break;
+    case mtype::bold:
+        m_inline += "**";
+        break;
+    case mtype::code:
+        m_inline += "`";
+        m_code_level++;
+        break;
+    case mtype::link:
+        m_inline += "[";
+        m_links.push_back(link_href(link.ToString(), m_filename_cb, m_mname_cb));
+        break;
+    default:
+        break;
+    }
+}
+
+void PodMarkdownRenderer::MarkupEnd(mtype t, PodStringRef arg)
+{
+    switch (t) {
+    case mtype::italic:
+    case mtype::filename: // fall-through
+        m_inline += "*";
+        break;
+    case mtype::bold:
+        m_inline += "**";
+        break;
+    case mtype::code:
+        m_inline += "`";
+        m_code_level--;
+        break;
+    case mtype::link:
+        if (!m_links.empty()) {
+            m_inline += "](" + m_links.back() + ")";
+            m_links.pop_back();
+        }
+        break;
+    case mtype::escape: {
+        std::string utf8;
+        if (resolve_escape_code(arg.ToString(), utf8))
+            Text(PodStringRef(utf8)); }
+        break;
+    default:
+        break;
+    }
+}
+
+void PodMarkdownRenderer::Text(PodStringRef text)
+{
+    std::string unescaped;
+    append_unescaped(unescaped, text);
+    if (m_code_level > 0) {
+        m_inline += unescaped;
+        return;
+    }
+
+    for (char ch: unescaped) {
+        if (strchr("\\`*_[]<>#", ch))
+            m_inline += '\\';
+        m_inline += ch;
+    }
+}
+
+void PodMarkdownRenderer::Data(PodStringRef format, PodStringRef data)
+{
+    if ((format.Size() == 8 && memcmp(format.Data(), "markdown", 8) == 0) ||
+        (format.Size() == 4 && memcmp(format.Data(), "html", 4) == 0)) {
+        m_result.append(data.Data(), data.Size());
+        m_result += "\n";
+    }
+}
+
+void PodMarkdownRenderer::Verbatim(PodStringRef text, size_t indent)
+{
+    if (!m_bullet.empty())
+        add_block("");
+
+    std::string prefix = m_indents.empty() ? std::string() : m_indents.back();
+    std::string unindented;
+    append_unindented(unindented, text, indent);
+
+    m_result += prefix + "```\n";
+    std::istringstream lines(unindented);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (!line.empty())
+            m_result += prefix + line;
+        m_result += "\n";
+    }
+    m_result += prefix + "```\n\n";
+}
+
+// Appends `text' as a paragraph, which is the first of an item if
+// m_bullet is set.
+void PodMarkdownRenderer::add_block(const std::string& text)
+{
+    std::string prefix = m_indents.empty() ? std::string() : m_indents.back();
+    if (!m_bullet.empty()) {
+        prefix.resize(prefix.length() > m_bullet.length() ? prefix.length() - m_bullet.length() - 1 : 0);
+        prefix += m_bullet + " ";
+        m_bullet.clear();
+    }
+
+    m_result += prefix + text + "\n\n";
+}
+
+// Emits the bullet of an =item without a paragraph as an empty item,
+// so that the item is not lost.
+void PodMarkdownRenderer::flush_bullet()
+{
+    if (!m_bullet.empty())
+        add_block("");
+}
+
+// `text' with the backslashes roff would interpret escaped.
+static std::string roff_escape(const std::string& text)
+{
+    std::string result;
+    for (char ch: text) {
+        if (ch == '\\')
+            result += "\\e";
+        else
+            result += ch;
+    }
+    return result;
+}
+
+PodRoffRenderer::PodRoffRenderer()
+    : m_item_started(false)
+{
+}
+
+void PodRoffRenderer::HeadEnd(int level)
+{
+    std::string title = strip_spaces(m_inline);
+    m_inline.clear();
+
+    if (level == 1)
+        add_line(".SH " + title);
+    else if (level == 2)
+        add_line(".SS " + title);
+    else {
+        add_line(".PP");
+        add_text("\\fB" + title + "\\fR");
+    }
+    m_item_started = false;
+}
+
+void PodRoffRenderer::Over(OverListType, PodStringRef)
+{
+    if (!m_item_counts.empty())
+        add_line(".RS");
+    m_item_counts.push_back(0);
+}
+
+void PodRoffRenderer::ItemStart(OverListType t, PodStringRef label)
+{
+    if (m_item_counts.empty()) // =item outside =over
+        m_item_counts.push_back(0);
+    int number = ++m_item_counts.back();
+
+    switch (t) {
+    case OverListType::unordered:
+        add_line(".IP \\(bu 4");
+        break;
+    case OverListType::ordered:
+        add_line(".IP " + std::to_string(number) + ". 4");
+        break;
+    case OverListType::description:
+        add_line(".TP");
+        add_text(roff_escape(description_label(label)));
+        break;
+    }
+    m_item_started = true;
+}
+
+void PodRoffRenderer::Back(OverListType)
+{
+    if (!m_item_counts.empty())
+        m_item_counts.pop_back();
+    if (!m_item_counts.empty())
+        add_line(".RE");
+    m_item_started = false;
+}
+
+void PodRoffRenderer::ParaEnd()
+{
+    std::string text = strip_spaces(m_inline);
+    m_inline.clear();
+    if (text.empty()) // E.g. the empty paragraph after =item
+        return;
+
+    if (!m_item_started)
+        add_line(m_item_counts.empty() ? ".PP" : ".IP");
+    m_item_started = false;
+    add_text(text);
+}
+
+void PodRoffRenderer::MarkupStart(mtype t, PodStringRef)
+{
+    switch (t) {
+    case mtype::italic:
+    case mtype::filename: // fall-through
+        m_fonts.push_back("I");
+        break;
+    case mtype::bold:
+        m_fonts.push_back("B");
+        break;
+    case mtype::code:
+        m_fonts.push_back("(CW");
+        break;
+    default:
+        return;
     }
+    m_inline += "\\f" + m_fonts.back();
 }
 
-std::string PodNodeInlineText::ToHTML() const
+// Fonts are restored explicitly, as \fP only remembers one font.
+void PodRoffRenderer::MarkupEnd(mtype t, PodStringRef arg)
 {
-    return m_text;
+    switch (t) {
+    case mtype::italic:
+    case mtype::filename: // fall-through
+    case mtype::bold:     // fall-through
+    case mtype::code:     // fall-through
+        if (!m_fonts.empty())
+            m_fonts.pop_back();
+        m_inline += "\\f" + (m_fonts.empty() ? std::string("R") : m_fonts.back());
+        break;
+    case mtype::escape: {
+        std::string utf8;
+        if (resolve_escape_code(arg.ToString(), utf8))
+            m_inline += roff_escape(utf8); }
+        break;
+    default:
+        break;
+    }
 }
 
-PodNodeInlineMarkupStart::PodNodeInlineMarkupStart(mtype type, std::initializer_list<std::string> args)
-    : m_mtype(type),
-      m_args(args),
-      m_filename_cb(nullptr),
-      m_mname_cb(nullptr)
+void PodRoffRenderer::Text(PodStringRef text)
 {
+    std::string unescaped;
+    append_unescaped(unescaped, text);
+    m_inline += roff_escape(unescaped);
 }
 
-// If for whatever reason the PodNodeInlineMarkupStart cannot be constructed
-// directly with the argument list, use this function to inject the arguments
-// later on.
-void PodNodeInlineMarkupStart::AddArgument(const std::string& arg)
+void PodRoffRenderer::Data(PodStringRef format, PodStringRef data)
 {
-    m_args.push_back(arg);
+    if ((format.Size() == 3 && memcmp(format.Data(), "man", 3) == 0) ||
+        (format.Size() == 4 && memcmp(format.Data(), "roff", 4) == 0)) {
+        m_result.append(data.Data(), data.Size());
+        if (!m_result.empty() && m_result.back() != '\n')
+            m_result += "\n";
+    }
 }
 
-// Set the filename calculation callback used for calculating L<> internal
-// link targets.
-void PodNodeInlineMarkupStart::SetFilenameCallback(std::string (*cb)(std::string))
+void PodRoffRenderer::Verbatim(PodStringRef text, size_t indent)
 {
-    m_filename_cb = cb;
+    if (!m_item_started)
+        add_line(m_item_counts.empty() ? ".PP" : ".IP");
+    m_item_started = false;
+
+    std::string unindented;
+    append_unindented(unindented, text, indent);
+    add_line(".nf");
+    add_line(".ft CW");
+    std::istringstream lines(unindented);
+    std::string line;
+    while (std::getline(lines, line)) {
+        add_text(roff_escape(line));
+    }
+    add_line(".ft R");
+    add_line(".fi");
 }
 
-// Set the method name ID calculation callback used for calculating L<> internal
-// link targets.
-void PodNodeInlineMarkupStart::SetMethodnameCallback(std::string (*cb)(bool, std::string))
+void PodRoffRenderer::add_line(const std::string& request)
 {
-    m_mname_cb = cb;
+    m_result += request + "\n";
 }
 
-std::string PodNodeInlineMarkupStart::ToHTML() const
+// Appends the line `text', protected from being taken for a request.
+void PodRoffRenderer::add_text(const std::string& text)
 {
-    size_t pos = std::string::npos;
-    std::string link_target;
+    if (!text.empty() && (text[0] == '.' || text[0] == '\''))
+        m_result += "\\&";
+    m_result += text + "\n";
+}
 
-    switch (m_mtype) {
-    case mtype::none:
-    case mtype::nbsp:   // fall-through
-    case mtype::zap:    // fall-through
-    case mtype::escape: // fall-through
-    case mtype::index:  // fall-through
-        return "";
-    case mtype::italic:
-        return "<i>";
-    case mtype::bold:
-        return "<b>";
-    case mtype::code:
-        return "<tt>";
-    case mtype::filename:
-        return "<span class=\"filename\">";
-    case mtype::link:
-        if ((pos = m_args[0].find('|')) != std::string::npos) // Single = intended
-            link_target = m_args[0].substr(pos+1);
-        else // Implicit link target
-            link_target = m_args[0];
+/***************************************
+ * Outline and search terms
+ **************************************/
 
-        if (link_target.find('<') != std::string::npos) {
-            std::cerr << "Warning: Use of formatting codes inside link target '" << link_target << "' is unsupported (deviation from canonical POD syntax)" << std::endl;
-        }
+PodTOCRenderer::PodTOCRenderer()
+    : m_in_heading(false)
+{
+}
 
-        if (link_target.find("://") == std::string::npos) { // Target is no url
-            // Check if UNIX man(1) page. (= special kind of external link)
-            std::string manpage;
-            std::string section;
-            if (check_manpage(link_target, manpage, section)) { // It's a manpage.
-                return std::string("<a href=\"https://linux.die.net/man/") + section + "/" + manpage + "\">";
-            }
-            /* It's a link to something in the docs itself (= internal link)
-             * There are two kind of these:
-             * 1. Thing/section, with /section being optional (meaning a heading)
-             * 2. Thing#method or Thing::method, with #method and ::method being optional
-             *    This is an extension over canonical POD markup.
-             * That is, "Thing" alone is ambiguous. But as it evaluates
-             * to the same target (`classmodname' below), this is not
-             * relevant. It's processed via variant 1. */
-            if (((pos = link_target.find("#")) != std::string::npos) ||
-                ((pos = link_target.find("::")) != std::string::npos)) { // Variant 2
-                bool is_cmethod = link_target[pos] == ':';
-                std::string classmodname = link_target.substr(0, pos);
-                std::string methodname   = link_target.substr(is_cmethod ? pos+2 : pos+1);
-
-                if (classmodname.empty()) { // Link to method doc in thid document
-                    return std::string("<a href=\"#") + m_mname_cb(is_cmethod, methodname) + "\">";
-                }
-                else { // Link to method doc in different document
-                    return std::string("<a href=\"") + m_filename_cb(classmodname) + "#" + m_mname_cb(is_cmethod, methodname) + "\">";
-                }
-            }
-            else { // Variant 1
-                // Split class/module name off section link at the slash, if present.
-                std::string classmodname;
-                if ((pos = link_target.find("/")) != std::string::npos) {
-                    classmodname = link_target.substr(0, pos);
-                    section = link_target.substr(pos+1);
-                }
-                else
-                    classmodname = link_target;
+void PodTOCRenderer::HeadStart(int level, PodStringRef anchor)
+{
+    PodHeading heading;
+    heading.level       = level;
+    heading.anchor      = anchor.ToString();
+    heading.first_token = std::string::npos;
+    heading.last_token  = std::string::npos;
 
-                if (classmodname.empty()) { // Means link to section in current document
-                    if (section.empty())
-                        std::cerr << "Warning: empty link target" << std::endl;
+    // Same nesting as in PodParser::parse_command()
+    heading.parent = m_outline.empty() ? std::string::npos : m_outline.size() - 1;
+    while (heading.parent != std::string::npos && m_outline[heading.parent].level >= level)
+        heading.parent = m_outline[heading.parent].parent;
 
-                    return std::string("<a href=\"#") + PodParser::MakeHeadingAnchorName(section) + "\">";
-                }
-                else { // Means link to different document
-                    if (section.empty()) {
-                        return std::string("<a href=\"") + m_filename_cb(classmodname) + "\">";
-                    }
-                    else {
-                        return std::string("<a href=\"") + m_filename_cb(classmodname) + "#" + PodParser::MakeHeadingAnchorName(section) + "\">";
-                    }
-                }
-            }
-        }
-        else { // Target is url (= external link)
-            return std::string("<a href=\"") + link_target + "\">";
-        }
-    }
+    m_outline.push_back(heading);
+    m_text.clear();
+    m_in_heading = true;
+}
 
-    throw(std::runtime_error("This should never be reached"));
+void PodTOCRenderer::HeadEnd(int)
+{
+    if (m_in_heading && !m_outline.empty())
+        m_outline.back().text = strip_spaces(m_text);
+    m_in_heading = false;
 }
 
-PodNodeInlineMarkupEnd::PodNodeInlineMarkupEnd(mtype type, std::initializer_list<std::string> args)
-    : m_mtype(type),
-      m_args(args)
+void PodTOCRenderer::Text(PodStringRef text)
 {
+    if (m_in_heading)
+        append_unescaped(m_text, text);
 }
 
-std::string PodNodeInlineMarkupEnd::ToHTML() const
+std::string PodTOCRenderer::GetResult() const
 {
-    switch (m_mtype) {
-    case mtype::none:
-    case mtype::nbsp: // fall-through
-    case mtype::zap:  // fall-through
-        return "";
-    case mtype::italic:
-        return "</i>";
-    case mtype::bold:
-        return "</b>";
-    case mtype::code:
-        return "</tt>";
-    case mtype::filename:
-        return "</span>";
-    case mtype::link:
-        return "</a>";
-    case mtype::escape:
-        if (m_args[0] == "verbar")
-            return "|";
-        else if (m_args[0] == "sol")
-            return "/";
-        else if (m_args[0] == "lchevron")
-            return "&laquo;";
-        else if (m_args[0] == "rchevron")
-            return "&raquo;";
-        else // FIXME: Check if args[0] is actually a valid escape code
-            return std::string("&") + m_args[0] + ";";
-    case mtype::index:
-        return std::string("<a class=\"idxentry\" name=\"idx-") + m_args[0] + "\"></a>";
+    return FormatTOC(m_outline);
+}
+
+static inline bool is_word_char(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+        ch == '_' || (static_cast<unsigned char>(ch) & 0x80);
+}
+
+PodTermRenderer::PodTermRenderer()
+    : m_word_weight(0),
+      m_code_level(0),
+      m_in_heading(false)
+{
+}
+
+void PodTermRenderer::HeadStart(int, PodStringRef)
+{
+    end_word();
+    m_in_heading = true;
+}
+
+void PodTermRenderer::HeadEnd(int)
+{
+    end_word();
+    m_in_heading = false;
+}
+
+void PodTermRenderer::ItemStart(OverListType t, PodStringRef label)
+{
+    // The label of description items is no text token
+    if (t == OverListType::description) {
+        end_word();
+        add_words(label, heading_weight);
+        end_word();
     }
+}
 
-    throw(std::runtime_error("This should never be reached"));
+void PodTermRenderer::ParaEnd()
+{
+    end_word();
 }
 
-PodNodeData::PodNodeData(std::string data, std::vector<std::string> arguments)
-    : m_data(data),
-      m_arguments(arguments)
+void PodTermRenderer::MarkupStart(mtype t, PodStringRef arg)
 {
+    if (t == mtype::code)
+        m_code_level++;
+    else if (t == mtype::index) { // `arg' is the keyword as written
+        std::string keyword(arg.ToString());
+        html_escape(keyword); // As add_words() expects
+        end_word();
+        add_words(keyword, index_weight);
+        end_word();
+    }
 }
 
-std::string PodNodeData::ToHTML() const
+void PodTermRenderer::MarkupEnd(mtype t, PodStringRef)
 {
-    if (m_arguments[0] == "html")
-        return m_data;
-    else
-        return "";
+    if (t == mtype::code)
+        m_code_level--;
 }
 
-PodNodeVerbatim::PodNodeVerbatim(std::string text)
-    : m_text(text)
+void PodTermRenderer::Text(PodStringRef text)
 {
+    add_words(text, m_in_heading ? heading_weight : m_code_level > 0 ? code_weight : body_weight);
 }
 
-void PodNodeVerbatim::AddText(std::string text)
+void PodTermRenderer::Verbatim(PodStringRef text, size_t)
 {
-    m_text += text;
+    end_word();
+    add_words(text, code_weight);
+    end_word();
 }
 
-std::string PodNodeVerbatim::ToHTML() const
+// Adds the words in the HTML-escaped `text' with `weight'. The last
+// one may be continued by the next call.
+void PodTermRenderer::add_words(PodStringRef text, unsigned int weight)
+{
+    std::string unescaped;
+    append_unescaped(unescaped, text);
+
+    for (size_t i=0; i < unescaped.length(); i++) {
+        char ch = unescaped[i];
+        if (ch == '\xC2' && i+1 < unescaped.length() && unescaped[i+1] == '\xA0') { // No-break space
+            end_word();
+            i++;
+            continue;
+        }
+        else if (!is_word_char(ch)) {
+            end_word();
+            continue;
+        }
+
+        if (m_word.empty())
+            m_word_weight = weight;
+        m_word += ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+    }
+}
+
+void PodTermRenderer::end_word()
 {
-    return std::string("<pre>") + m_text + std::string("</pre>\n");
+    if (!m_word.empty()) {
+        m_terms[m_word] += m_word_weight;
+        m_word.clear();
+    }
 }
 
 /***************************************
- * Formatter
+ * Search index
  **************************************/
 
-std::string Pod::FormatHTML(const std::vector<PodNode*>& tokens)
+static const char s_search_magic[4] = {'P', 'O', 'D', 'I'};
+static const size_t s_search_header_words = 7;
+
+const uint32_t PodSearchIndexView::version;
+
+size_t PodSearchIndexBuilder::AddDocument(const std::string& name, const std::unordered_map<std::string, unsigned int>& terms)
 {
-    std::string result;
+    m_names.push_back(name);
+    m_terms.emplace_back(terms.begin(), terms.end());
+    std::sort(m_terms.back().begin(), m_terms.back().end());
+    return m_names.size() - 1;
+}
 
-    for (const PodNode* p_node: tokens) {
-        result += p_node->ToHTML();
+/**
+ * Serializes the index for PodSearchIndexView. The sorted terms of
+ * the documents are merged, so that each term is stored once, with
+ * the postings of all documents that contain it.
+ */
+std::string PodSearchIndexBuilder::Serialize() const
+{
+    std::string docs;
+    std::string terms;
+    std::string postings;
+    std::string text;
+    size_t term_count = 0;
+    size_t posting_count = 0;
+
+    for (const std::string& name: m_names) {
+        append_text_ref(docs, text, name);
     }
 
-    return result;
+    // Merge the per-document term lists. Each cursor is a document
+    // and a position in its list; the queue yields the smallest
+    // term first, and of equal terms the one of the first document.
+    typedef std::pair<size_t, size_t> cursor;
+    auto later = [this](const cursor& a, const cursor& b) {
+        int cmp = m_terms[a.first][a.second].first.compare(m_terms[b.first][b.second].first);
+        return cmp > 0 || (cmp == 0 && a.first > b.first);
+    };
+    std::priority_queue<cursor, std::vector<cursor>, decltype(later)> queue(later);
+    for (size_t doc=0; doc < m_terms.size(); doc++) {
+        if (!m_terms[doc].empty())
+            queue.push(cursor(doc, 0));
+    }
+
+    const std::string* p_last_term = nullptr;
+    size_t first_posting = 0;
+    while (!queue.empty()) {
+        cursor next = queue.top();
+        queue.pop();
+        const std::pair<std::string, unsigned int>& term = m_terms[next.first][next.second];
+
+        if (!p_last_term || *p_last_term != term.first) {
+            if (p_last_term) {
+                append_u32(terms, first_posting);
+                append_u32(terms, posting_count - first_posting);
+            }
+            append_text_ref(terms, text, term.first);
+            first_posting = posting_count;
+            p_last_term = &term.first;
+            term_count++;
+        }
+        append_u32(postings, next.first);
+        append_u32(postings, term.second);
+        posting_count++;
+
+        if (++next.second < m_terms[next.first].size())
+            queue.push(next);
+    }
+    if (p_last_term) {
+        append_u32(terms, first_posting);
+        append_u32(terms, posting_count - first_posting);
+    }
+
+    std::string blob(s_search_magic, sizeof(s_search_magic));
+    append_u32(blob, PodSearchIndexView::version);
+    append_u32(blob, s_blob_bom);
+    append_u32(blob, m_names.size());
+    append_u32(blob, term_count);
+    append_u32(blob, posting_count);
+    append_u32(blob, text.length());
+    blob += docs;
+    blob += terms;
+    blob += postings;
+    blob += text;
+
+    return blob;
+}
+
+/**
+ * Maps a view onto the serialized search index of `size' bytes at
+ * `p_blob'. As with PodTokenView, the blob is checked, not copied.
+ */
+PodSearchIndexView::PodSearchIndexView(const void* p_blob, size_t size)
+{
+    const char* p_bytes = static_cast<const char*>(p_blob);
+    const uint32_t* p_header = static_cast<const uint32_t*>(p_blob);
+
+    if (reinterpret_cast<uintptr_t>(p_blob) % 4 != 0)
+        throw(std::runtime_error("Serialized search index is not aligned"));
+    if (size < s_search_header_words * 4 || memcmp(p_bytes, s_search_magic, sizeof(s_search_magic)) != 0)
+        throw(std::runtime_error("Not a serialized search index"));
+    if (p_header[1] != version)
+        throw(std::runtime_error("Unsupported serialized search index version " + std::to_string(p_header[1])));
+    if (p_header[2] != s_blob_bom)
+        throw(std::runtime_error("Serialized search index has foreign byte order"));
+
+    m_doc_count = p_header[3];
+    m_term_count = p_header[4];
+    size_t posting_count = p_header[5];
+    size_t text_size = p_header[6];
+
+    uint64_t pos = s_search_header_words * 4;
+    uint64_t docs_pos = pos;
+    pos += 8 * static_cast<uint64_t>(m_doc_count);
+    uint64_t terms_pos = pos;
+    pos += 16 * static_cast<uint64_t>(m_term_count);
+    uint64_t postings_pos = pos;
+    pos += 8 * static_cast<uint64_t>(posting_count);
+    uint64_t text_pos = pos;
+    pos += text_size;
+    if (pos > size)
+        throw(std::runtime_error("Serialized search index is truncated"));
+
+    mp_docs     = reinterpret_cast<const uint32_t*>(p_bytes + docs_pos);
+    mp_terms    = reinterpret_cast<const uint32_t*>(p_bytes + terms_pos);
+    mp_postings = reinterpret_cast<const uint32_t*>(p_bytes + postings_pos);
+    mp_text     = p_bytes + text_pos;
+
+    for (size_t doc=0; doc < m_doc_count; doc++) {
+        if (static_cast<uint64_t>(mp_docs[2*doc]) + mp_docs[2*doc + 1] > text_size)
+            throw(std::runtime_error("Serialized search index has invalid document " + std::to_string(doc)));
+    }
+    for (size_t n=0; n < m_term_count; n++) {
+        const uint32_t* p_term = mp_terms + 4*n;
+        if (static_cast<uint64_t>(p_term[0]) + p_term[1] > text_size
+            || static_cast<uint64_t>(p_term[2]) + p_term[3] > posting_count)
+            throw(std::runtime_error("Serialized search index has invalid term " + std::to_string(n)));
+    }
+    for (size_t k=0; k < posting_count; k++) {
+        if (mp_postings[2*k] >= m_doc_count)
+            throw(std::runtime_error("Serialized search index has invalid posting " + std::to_string(k)));
+    }
+}
+
+size_t PodSearchIndexView::FindTerm(const std::string& term) const
+{
+    size_t first = 0;
+    size_t last = m_term_count;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        PodStringRef candidate = GetTerm(middle);
+        int cmp = memcmp(candidate.Data(), term.data(), std::min(candidate.Size(), term.length()));
+        if (cmp < 0 || (cmp == 0 && candidate.Size() < term.length()))
+            first = middle + 1;
+        else
+            last = middle;
+    }
+
+    if (first < m_term_count && GetTerm(first).Size() == term.length()
+        && memcmp(GetTerm(first).Data(), term.data(), term.length()) == 0)
+        return first;
+    return std::string::npos;
 }
 
 /***************************************
  * Helpers
  **************************************/
 
-size_t Pod::count_leading_whitespace(const std::string& str)
+std::string Pod::format_diagnostic(const PodDiagnostic& diag)
+{
+    std::string result;
+    switch (diag.severity) {
+    case DiagnosticSeverity::info:
+        result = "Info";
+        break;
+    case DiagnosticSeverity::warning:
+        result = "Warning";
+        break;
+    case DiagnosticSeverity::error:
+        result = "Error";
+        break;
+    }
+
+    result += " on line " + std::to_string(diag.line);
+    if (diag.column > 0)
+        result += ", column " + std::to_string(diag.column);
+
+    return result + ": " + diag.message;
+}
+
+// Code dumps are indented with runs of spaces, so these are skipped
+// eight at a time before looking at the single characters.
+size_t Pod::count_leading_whitespace(PodStringRef str)
 {
+    static const uint64_t spaces = 0x2020202020202020ULL;
+
     size_t count = 0;
-    while (str[count] == ' ' || str[count] == '\t')
+    uint64_t chunk;
+    while (str.Size() - count >= sizeof(chunk)) {
+        memcpy(&chunk, str.Data() + count, sizeof(chunk));
+        if (chunk != spaces)
+            break;
+        count += sizeof(chunk);
+    }
+    while (count < str.Size() && (str[count] == ' ' || str[count] == '\t'))
         count++;
     return count;
 }
 
+// Only white space is removed, so a line indented less than `indent'
+// (like the empty lines that join verbatim paragraphs) keeps its text.
+void Pod::append_unindented(std::string& result, PodStringRef text, size_t indent)
+{
+    if (indent == 0) {
+        result.append(text.Data(), text.Size());
+        return;
+    }
+
+    size_t start = 0;
+    while (start < text.Size()) {
+        const char* p_eol = static_cast<const char*>(memchr(text.Data() + start, '\n', text.Size() - start));
+        size_t end = p_eol ? p_eol - text.Data() + 1 : text.Size();
+        size_t skip = std::min(indent, count_leading_whitespace(PodStringRef(text.Data() + start, end - start)));
+
+        result.append(text.Data() + start + skip, end - start - skip);
+        start = end;
+    }
+}
+
+bool Pod::write_fragments(int fd, const std::vector<PodStringRef>& fragments)
+{
+#ifdef IOV_MAX
+    static const size_t max_iov = IOV_MAX;
+#else
+    static const size_t max_iov = 1024;
+#endif
+    std::vector<struct iovec> iov(std::min(fragments.size(), max_iov));
+
+    size_t first = 0;  // First fragment not completely written
+    size_t written = 0; // Bytes of it that are
+    while (first < fragments.size()) {
+        size_t count = std::min(fragments.size() - first, max_iov);
+        for (size_t i=0; i < count; i++) {
+            iov[i].iov_base = const_cast<char*>(fragments[first + i].Data());
+            iov[i].iov_len  = fragments[first + i].Size();
+        }
+        iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + written;
+        iov[0].iov_len -= written;
+
+        ssize_t result = writev(fd, iov.data(), count);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip what has been written, which may end inside a fragment
+        size_t remaining = result;
+        while (first < fragments.size() && remaining >= fragments[first].Size() - written) {
+            remaining -= fragments[first].Size() - written;
+            written = 0;
+            first++;
+        }
+        written += remaining;
+    }
+
+    return true;
+}
+
+void Pod::append_unescaped(std::string& result, PodStringRef text)
+{
+    static const struct {
+        const char* escaped;
+        size_t length;
+        const char* replacement;
+    } escapes[] = {{"&amp;", 5, "&"}, {"&lt;", 4, "<"}, {"&gt;", 4, ">"}, {"&nbsp;", 6, "\xC2\xA0"}};
+
+    size_t start = 0;
+    for (size_t pos=0; pos < text.Size(); pos++) {
+        if (text[pos] != '&')
+            continue;
+
+        for (const auto& escape: escapes) {
+            if (text.Size() - pos >= escape.length && memcmp(text.Data() + pos, escape.escaped, escape.length) == 0) {
+                result.append(text.Data() + start, pos - start);
+                result += escape.replacement;
+                pos += escape.length - 1;
+                start = pos + 1;
+                break;
+            }
+        }
+    }
+    result.append(text.Data() + start, text.Size() - start);
+}
+
 std::string Pod::join_vectorstr(const std::vector<std::string>& vec, const std::string& separator)
 {
     std::string result;
@@ -1149,16 +4344,116 @@ std::string Pod::join_vectorstr(const std::vector<std::string>& vec, const std::
 
 void Pod::html_escape(std::string& str, bool nbsp)
 {
+    size_t pos = str.find_first_of(nbsp ? "&<> " : "&<>");
+    if (pos == std::string::npos)
+        return;
+
+    std::string result(str, 0, pos);
+    result.reserve(str.length() + 16);
+    for (; pos < str.length(); pos++) {
+        switch (str[pos]) {
+        case '&':
+            result += "&amp;";
+            break;
+        case '<':
+            result += "&lt;";
+            break;
+        case '>':
+            result += "&gt;";
+            break;
+        case ' ':
+            if (nbsp)
+                result += "&nbsp;";
+            else
+                result += ' ';
+            break;
+        default:
+            result += str[pos];
+            break;
+        }
+    }
+    str.swap(result);
+}
+
+/* Perfect hash over the names of the escape codes, see
+ * tools/gen_entities.py, which generates the tables in
+ * pod_entities.inc. */
+static constexpr uint32_t s_entity_basis = 2166136261u;
+
+static constexpr uint32_t entity_hash(const char* p_name, size_t length, uint32_t basis)
+{
+    return length == 0 ? basis : entity_hash(p_name + 1, length - 1, (basis ^ static_cast<unsigned char>(*p_name)) * 16777619u);
+}
+
+#include "pod_entities.inc"
+
+bool Pod::resolve_escape_code(const std::string& ecode, std::string& utf8)
+{
+    if (ecode.empty())
+        return false;
+
+    if (ecode[0] < '0' || ecode[0] > '9') { // Name
+        uint32_t bucket = entity_hash(ecode.data(), ecode.length(), s_entity_basis) % s_entity_buckets;
+        uint32_t slot = entity_hash(ecode.data(), ecode.length(), s_entity_basis ^ s_entity_displacements[bucket]) & (s_entity_slots - 1);
+        uint16_t index = s_entity_slot_index[slot];
+        if (index == 0xffff || ecode != s_entities[index].name)
+            return false;
+
+        utf8 = s_entities[index].utf8;
+        return true;
+    }
+
+    unsigned int base = 10;
     size_t pos = 0;
-    while ((pos = str.find("&")) != std::string::npos && str.substr(pos, 5) != "&amp;")
-        str.replace(pos, 1, "&amp;");
-    while ((pos = str.find("<")) != std::string::npos)
-        str.replace(pos, 1, "&lt;");
-    while ((pos = str.find(">")) != std::string::npos)
-        str.replace(pos, 1, "&gt;");
-    if (nbsp)
-        while ((pos = str.find(" ")) != std::string::npos)
-            str.replace(pos, 1, "&nbsp;");
+    if (ecode.length() > 2 && ecode[0] == '0' && (ecode[1] == 'x' || ecode[1] == 'X')) {
+        base = 16;
+        pos = 2;
+    }
+    else if (ecode.length() > 1 && ecode[0] == '0') {
+        base = 8;
+        pos = 1;
+    }
+
+    uint32_t codepoint = 0;
+    for (; pos < ecode.length(); pos++) {
+        char ch = ecode[pos];
+        unsigned int digit = 16;
+        if (ch >= '0' && ch <= '9')
+            digit = ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            digit = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'F')
+            digit = ch - 'A' + 10;
+
+        if (digit >= base)
+            return false;
+        codepoint = codepoint * base + digit;
+        if (codepoint > 0x10ffff)
+            return false;
+    }
+    if (codepoint == 0 || (codepoint >= 0xd800 && codepoint <= 0xdfff))
+        return false;
+
+    utf8.clear();
+    if (codepoint < 0x80) {
+        utf8 += static_cast<char>(codepoint);
+    }
+    else if (codepoint < 0x800) {
+        utf8 += static_cast<char>(0xc0 | (codepoint >> 6));
+        utf8 += static_cast<char>(0x80 | (codepoint & 0x3f));
+    }
+    else if (codepoint < 0x10000) {
+        utf8 += static_cast<char>(0xe0 | (codepoint >> 12));
+        utf8 += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        utf8 += static_cast<char>(0x80 | (codepoint & 0x3f));
+    }
+    else {
+        utf8 += static_cast<char>(0xf0 | (codepoint >> 18));
+        utf8 += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
+        utf8 += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        utf8 += static_cast<char>(0x80 | (codepoint & 0x3f));
+    }
+    return true;
 }
 
 bool Pod::check_manpage(const std::string& target, std::string& manpage, std::string& section)
@@ -1175,3 +4470,56 @@ bool Pod::check_manpage(const std::string& target, std::string& manpage, std::st
     }
     return false;
 }
+
+PodLinkTarget Pod::parse_link_target(const std::string& target)
+{
+    PodLinkTarget result;
+    size_t pos = std::string::npos;
+
+    if (target.find("://") != std::string::npos) { // Target is url (= external link)
+        result.kind = LinkKind::url;
+        result.name = target;
+    }
+    // Check if UNIX man(1) page. (= special kind of external link)
+    else if (check_manpage(target, result.document, result.name)) {
+        result.kind = LinkKind::manpage;
+    }
+    /* A section name in quotes, "Section" or Thing/"Section", is
+     * taken as it is, even if it contains "#" or "::". */
+    else if (target.length() >= 2 && target.back() == '"'
+             && (pos = target.find('"')) < target.length() - 1
+             && (pos == 0 || target[pos-1] == '/')) {
+        result.kind = LinkKind::section;
+        result.document = target.substr(0, pos == 0 ? 0 : pos - 1);
+        result.name     = target.substr(pos + 1, target.length() - pos - 2);
+    }
+    /* It's a link to something in the docs itself (= internal link)
+     * There are two kind of these:
+     * 1. Thing/section, with /section being optional (meaning a heading)
+     * 2. Thing#method or Thing::method, with #method and ::method being optional
+     *    This is an extension over canonical POD markup.
+     * That is, "Thing" alone is ambiguous. But as it evaluates
+     * to the same target (`document' below), this is not
+     * relevant. It's processed via variant 1. */
+    else if (((pos = target.find("#")) != std::string::npos) ||
+             ((pos = target.find("::")) != std::string::npos)) { // Variant 2
+        bool is_cmethod = target[pos] == ':';
+        result.kind = is_cmethod ? LinkKind::class_method : LinkKind::instance_method;
+        result.document = target.substr(0, pos);
+        result.name     = target.substr(is_cmethod ? pos+2 : pos+1);
+    }
+    // Variant 1. Split class/module name off section link at the slash, if present.
+    else if ((pos = target.find("/")) != std::string::npos) {
+        result.kind = LinkKind::section;
+        result.document = target.substr(0, pos);
+        result.name     = target.substr(pos+1);
+        if (result.name.empty() && !result.document.empty())
+            result.kind = LinkKind::document;
+    }
+    else {
+        result.kind = target.empty() ? LinkKind::section : LinkKind::document;
+        result.document = target;
+    }
+
+    return result;
+}
@@ -32,7 +32,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <initializer_list>
+#include <cstdint>
 
 #define POD_HPP
 /* These classes implement the Perl POD documentation format:
@@ -42,22 +45,65 @@
 
 namespace Pod {
 
+// Non-owning reference to a range of characters, e.g. a token's
+// payload inside a PodTokenStream. It is only valid for as long as
+// the referenced storage is.
+class PodStringRef
+{
+public:
+    PodStringRef() : m_data(""), m_size(0) {}
+    PodStringRef(const char* p_data, size_t size) : m_data(p_data), m_size(size) {}
+    PodStringRef(const std::string& str) : m_data(str.data()), m_size(str.length()) {}
+    inline const char* Data() const { return m_data; }
+    inline size_t Size() const { return m_size; }
+    inline bool Empty() const { return m_size == 0; }
+    inline char operator[](size_t i) const { return m_data[i]; }
+    inline std::string ToString() const { return std::string(m_data, m_size); }
+private:
+    const char* m_data;
+    size_t m_size;
+};
+
+// Text of a PodNode. It either owns its characters or borrows them
+// from the source document held by a PodTokenStream, which avoids
+// copying text that the parser passed through unchanged. Modifying
+// borrowed text makes it owned first.
+class PodText
+{
+public:
+    PodText() : m_ref(nullptr, 0) {}
+    explicit PodText(const std::string& str) : m_owned(str), m_ref(nullptr, 0) {}
+    static PodText Borrow(PodStringRef ref);
+
+    inline bool IsBorrowed() const { return m_ref.Data() != nullptr; }
+    inline PodStringRef Ref() const { return IsBorrowed() ? m_ref : PodStringRef(m_owned); }
+    inline std::string ToString() const { return IsBorrowed() ? m_ref.ToString() : m_owned; }
+    void Append(const std::string& text);
+    void Truncate(size_t length);
+private:
+    std::string m_owned;
+    PodStringRef m_ref; // Data() is nullptr if owned
+};
+
 class PodNode
 {
 public:
     PodNode() {};
     virtual ~PodNode() {};
     virtual std::string ToHTML() const = 0;
+    // Appends what ToHTML() returns to `result'.
+    virtual void AppendHTML(std::string& result) const { result += ToHTML(); }
 };
 
 class PodNodeHeadStart: public PodNode
 {
 public:
-    PodNodeHeadStart(int level, std::string content); // content is for ID generation
+    PodNodeHeadStart(int level, std::string anchor);
     virtual std::string ToHTML() const;
+    inline const std::string& GetAnchor() const { return m_anchor; }
 private:
     int m_level;
-    std::string m_content;
+    std::string m_anchor;
 };
 
 class PodNodeHeadEnd: public PodNode
@@ -93,6 +139,7 @@ public:
     virtual std::string ToHTML() const;
     const std::string& GetLabel() const;
     OverListType GetListType() const;
+    static OverListType ListTypeFromLabel(const std::string& label);
 private:
     std::string m_label;
     OverListType m_list_type;
@@ -139,33 +186,52 @@ enum class mtype {
     link
 };
 
+/* The argument of a formatting code: the link content of L<> with
+ * the callbacks to resolve it, the escape code of E<>, or the
+ * target of X<>. All other formatting codes have none, so markup
+ * nodes only allocate one when it's actually needed. */
+struct PodMarkupArgument
+{
+    PodMarkupArgument() : filename_cb(nullptr), mname_cb(nullptr) {}
+
+    std::string value;
+    std::string (*filename_cb)(std::string);
+    std::string (*mname_cb)(bool, std::string);
+};
+
 class PodNodeInlineMarkupStart: public PodNode
 {
 public:
     PodNodeInlineMarkupStart(mtype type, std::initializer_list<std::string> args = {});
+    PodNodeInlineMarkupStart(const PodNodeInlineMarkupStart&) = delete;
+    PodNodeInlineMarkupStart& operator=(const PodNodeInlineMarkupStart&) = delete;
+    virtual ~PodNodeInlineMarkupStart();
     virtual std::string ToHTML() const;
     inline mtype GetMtype() const { return m_mtype; };
 
-    // These three are only used for mtype::link:
+    // These three are only used for mtype::link.
     void AddArgument(const std::string& arg);
     void SetFilenameCallback(std::string (*cb)(std::string));
     void SetMethodnameCallback(std::string (*cb)(bool, std::string));
 private:
+    PodMarkupArgument& argument();
+
     mtype m_mtype;
-    std::vector<std::string> m_args;
-    std::string (*m_filename_cb)(std::string);
-    std::string (*m_mname_cb)(bool, std::string);
+    PodMarkupArgument* mp_arg; // nullptr unless needed
 };
 
 class PodNodeInlineMarkupEnd: public PodNode
 {
 public:
     PodNodeInlineMarkupEnd(mtype type, std::initializer_list<std::string> args = {});
+    PodNodeInlineMarkupEnd(const PodNodeInlineMarkupEnd&) = delete;
+    PodNodeInlineMarkupEnd& operator=(const PodNodeInlineMarkupEnd&) = delete;
+    virtual ~PodNodeInlineMarkupEnd();
     virtual std::string ToHTML() const;
     inline mtype GetMtype() const { return m_mtype; };
 private:
     mtype m_mtype;
-    std::vector<std::string> m_args;
+    PodMarkupArgument* mp_arg; // nullptr unless the first of `args' is given
 };
 
 // This node class is for the downmost-possible unit, i.e. the actual text.
@@ -173,22 +239,25 @@ class PodNodeInlineText: public PodNode
 {
 public:
     PodNodeInlineText(std::string text);
+    PodNodeInlineText(PodText text);
     PodNodeInlineText(char ch);
     virtual std::string ToHTML() const;
     void AddText(const std::string& text);
     void AddText(char ch);
     void StripTrailingWhitespace();
 private:
-    std::string m_text;
+    PodText m_text;
 };
 
 class PodNodeData: public PodNode
 {
 public:
     PodNodeData(std::string data, std::vector<std::string> arguments);
+    PodNodeData(PodText data, std::vector<std::string> arguments);
     virtual std::string ToHTML() const;
+    virtual void AppendHTML(std::string& result) const;
 private:
-    std::string m_data;
+    PodText m_data;
     std::vector<std::string> m_arguments;
 };
 
@@ -196,10 +265,652 @@ class PodNodeVerbatim: public PodNode
 {
 public:
     PodNodeVerbatim(std::string text);
+    PodNodeVerbatim(PodText text, size_t indent); // indent is stripped from each line on output
     void AddText(std::string text);
     virtual std::string ToHTML() const;
+    virtual void AppendHTML(std::string& result) const;
+private:
+    PodText m_text;
+    size_t m_indent;
+};
+
+// Type tags of the tokens in a PodTokenStream. Each of them
+// corresponds to one of the PodNode subclasses.
+enum class ntype : unsigned char {
+    head_start,
+    head_end,
+    over,
+    item_start,
+    item_end,
+    back,
+    para_start,
+    para_end,
+    markup_start,
+    markup_end,
+    text,
+    data,
+    verbatim
+};
+
+/* Compact representation of a parsed document. Instead of one heap
+ * allocated PodNode per token, it keeps parallel arrays of token
+ * type, flags, and payload offset and length into a single text
+ * arena. What the flags hold depends on the token type:
+ *
+ * - head_start, head_end: the heading level
+ * - over, item_start, item_end, back: the OverListType
+ * - markup_start, markup_end: the mtype
+ * - verbatim: the indentation, i.e. the number of characters
+ *   to strip from the start of each line of the payload
+ *
+ * The payload is the text the corresponding PodNode would hold:
+ * heading anchor, item label, =over indent, link content or index
+ * keyword (markup_start of mtype::link and mtype::index), escape
+ * code or index target (markup_end of mtype::escape and
+ * mtype::index), text, verbatim
+ * text (still indented, see GetVerbatimText()), and data. Payloads
+ * are limited to 4 GiB in total.
+ *
+ * The stream keeps a copy of the source document. Text, verbatim
+ * and data payloads that are identical to a range of the source are
+ * not copied into the arena, but refer to that range instead; see
+ * IsBorrowed().
+ *
+ * Token streams are built by PodParser; call MakeNode() to obtain
+ * a classic PodNode for a token if needed. */
+class PodTokenStream
+{
+public:
+    PodTokenStream();
+
+    inline size_t Size() const { return m_types.size(); }
+    inline ntype GetNtype(size_t i) const { return m_types[i]; }
+    inline unsigned char GetFlags(size_t i) const { return m_flags[i] & ~borrowed_flag; }
+    inline int GetLevel(size_t i) const { return GetFlags(i); }
+    inline OverListType GetListType(size_t i) const { return static_cast<OverListType>(GetFlags(i)); }
+    inline mtype GetMtype(size_t i) const { return static_cast<mtype>(GetFlags(i)); }
+    inline bool IsBorrowed(size_t i) const { return (m_flags[i] & borrowed_flag) != 0; }
+    inline PodStringRef GetPayload(size_t i) const { return PodStringRef((IsBorrowed(i) ? m_source.data() : m_arena.data()) + m_offsets[i], m_lengths[i]); }
+    const std::vector<std::string>& GetDataArguments(size_t i) const;
+    PodStringRef GetDataFormat(size_t i) const;
+    std::string GetVerbatimText(size_t i) const;
+    inline const std::string& GetSource() const { return m_source; }
+
+    // Callbacks used for L<> targets, see PodParser::PodParser().
+    inline std::string (*GetFilenameCallback() const)(std::string) { return m_filename_cb; }
+    inline std::string (*GetMethodnameCallback() const)(bool, std::string) { return m_mname_cb; }
+
+    // Allocates the PodNode equivalent of token `i'. The caller
+    // is responsible for freeing it. Nodes of borrowed payloads refer
+    // to the source kept by this stream and must not outlive it.
+    PodNode* MakeNode(size_t i) const;
+private:
+    friend class PodParser;
+
+    // Set in m_flags for payloads that refer to m_source rather
+    // than to m_arena.
+    enum : unsigned char { borrowed_flag = 0x80 };
+
+    void clear(size_t retained_capacity);
+    size_t add(ntype t, unsigned char flags, const std::string& payload = std::string(), size_t source_offset = std::string::npos);
+    size_t add_borrowed(ntype t, unsigned char flags, size_t source_offset, size_t length);
+    void set_payload(size_t i, const std::string& payload);
+    void append_payload(size_t i, const std::string& text, size_t source_offset = std::string::npos);
+    void truncate_payload(size_t i, size_t length);
+    bool borrowable(const std::string& text, size_t source_offset) const;
+    void make_owned(size_t i);
+    void add_data_arguments(size_t i, const std::vector<std::string>& arguments);
+    size_t add_copy(const PodTokenStream& other, size_t i);
+    void move(size_t from, size_t to);
+    void erase(size_t first, size_t last);
+
+    std::vector<ntype> m_types;
+    std::vector<unsigned char> m_flags;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint32_t> m_lengths;
+    std::string m_arena;
+    std::string m_source;
+    // Arguments of data tokens, which are rare enough to be kept
+    // aside, sorted by token index.
+    std::vector<uint32_t> m_data_tokens;
+    std::vector<std::vector<std::string>> m_data_args;
+    std::string (*m_filename_cb)(std::string);
+    std::string (*m_mname_cb)(bool, std::string);
+};
+
+/* Read-only access to a token stream serialized with
+ * PodParser::Serialize(). The blob is used in place: nothing is
+ * parsed or copied, so the memory may just as well be a mmap(2)ed
+ * cache file. It has to stay valid and unchanged for the lifetime
+ * of the view and be aligned to 4 bytes. As the view never changes,
+ * it can be shared between threads.
+ *
+ * The accessors behave like those of PodTokenStream; payloads refer
+ * into the blob. The constructor throws std::runtime_error if the
+ * blob is malformed or of a different version or byte order. */
+class PodTokenView
+{
+public:
+    static const uint32_t version = 2;
+
+    PodTokenView(const void* p_blob, size_t size);
+
+    inline size_t Size() const { return m_count; }
+    inline ntype GetNtype(size_t i) const { return static_cast<ntype>(mp_types[i]); }
+    inline unsigned char GetFlags(size_t i) const { return mp_flags[i]; }
+    inline int GetLevel(size_t i) const { return mp_flags[i]; }
+    inline OverListType GetListType(size_t i) const { return static_cast<OverListType>(mp_flags[i]); }
+    inline mtype GetMtype(size_t i) const { return static_cast<mtype>(mp_flags[i]); }
+    inline PodStringRef GetPayload(size_t i) const { return PodStringRef(mp_text + mp_offsets[i], mp_lengths[i]); }
+    size_t GetDataArgumentCount(size_t i) const;
+    PodStringRef GetDataArgument(size_t i, size_t n) const;
+    PodStringRef GetDataFormat(size_t i) const;
+    std::string GetVerbatimText(size_t i) const;
+
+    // Index entries (see PodParser::GetIndexEntries()), sorted by keyword.
+    inline size_t GetIndexEntryCount() const { return m_index_count; }
+    inline PodStringRef GetIndexKeyword(size_t n) const { return text_ref(mp_index + 4*n); }
+    inline PodStringRef GetIndexTarget(size_t n) const { return text_ref(mp_index + 4*n + 2); }
 private:
+    inline PodStringRef text_ref(const uint32_t* p_ref) const { return PodStringRef(mp_text + p_ref[0], p_ref[1]); }
+    const uint32_t* find_data_token(size_t i) const;
+
+    size_t m_count;
+    size_t m_data_count;
+    size_t m_index_count;
+    const unsigned char* mp_types;
+    const unsigned char* mp_flags;
+    const uint32_t* mp_offsets;
+    const uint32_t* mp_lengths;
+    const uint32_t* mp_data;  // token index, first argument, argument count
+    const uint32_t* mp_args;  // text offset, length
+    const uint32_t* mp_index; // keyword offset, length, target offset, length
+    const char* mp_text;
+};
+
+/* Base class of renderers, which turn a PodTokenStream or a
+ * PodTokenView into some output format. A renderer derives from
+ * PodRenderer<itself> and defines those of the member functions
+ * below that it needs; the others do nothing:
+ *
+ *     class WordCounter: public PodRenderer<WordCounter> {
+ *     public:
+ *         void Text(PodStringRef text) { ... }
+ *     };
+ *
+ *     WordCounter counter;
+ *     counter.Render(parser.GetTokenStream());
+ *
+ * Render() walks the tokens once and calls the renderer's functions
+ * directly rather than through virtual functions, so that they can
+ * be inlined. Another overload renders only the tokens from `first'
+ * up to `last'. The arguments are the token's flags and payload as
+ * described for PodTokenStream. Note that the text is HTML-escaped;
+ * see append_unescaped(). */
+template<typename Renderer>
+class PodRenderer
+{
+public:
+    template<typename Tokens>
+    void Render(const Tokens& tokens);
+    template<typename Tokens>
+    void Render(const Tokens& tokens, size_t first, size_t last);
+
+    inline void HeadStart(int, PodStringRef) {}
+    inline void HeadEnd(int) {}
+    inline void Over(OverListType, PodStringRef) {}
+    inline void ItemStart(OverListType, PodStringRef) {}
+    inline void ItemEnd(OverListType) {}
+    inline void Back(OverListType) {}
+    inline void ParaStart() {}
+    inline void ParaEnd() {}
+    inline void MarkupStart(mtype, PodStringRef) {}
+    inline void MarkupEnd(mtype, PodStringRef) {}
+    inline void Text(PodStringRef) {}
+    inline void Data(PodStringRef, PodStringRef) {}
+    inline void Verbatim(PodStringRef, size_t) {}
+};
+
+template<typename Renderer>
+template<typename Tokens>
+void PodRenderer<Renderer>::Render(const Tokens& tokens)
+{
+    Render(tokens, 0, tokens.Size());
+}
+
+template<typename Renderer>
+template<typename Tokens>
+void PodRenderer<Renderer>::Render(const Tokens& tokens, size_t first, size_t last)
+{
+    Renderer& renderer = static_cast<Renderer&>(*this);
+
+    for (size_t i=first; i < last; i++) {
+        switch (tokens.GetNtype(i)) {
+        case ntype::head_start:
+            renderer.HeadStart(tokens.GetLevel(i), tokens.GetPayload(i));
+            break;
+        case ntype::head_end:
+            renderer.HeadEnd(tokens.GetLevel(i));
+            break;
+        case ntype::over:
+            renderer.Over(tokens.GetListType(i), tokens.GetPayload(i));
+            break;
+        case ntype::item_start:
+            renderer.ItemStart(tokens.GetListType(i), tokens.GetPayload(i));
+            break;
+        case ntype::item_end:
+            renderer.ItemEnd(tokens.GetListType(i));
+            break;
+        case ntype::back:
+            renderer.Back(tokens.GetListType(i));
+            break;
+        case ntype::para_start:
+            renderer.ParaStart();
+            break;
+        case ntype::para_end:
+            renderer.ParaEnd();
+            break;
+        case ntype::markup_start:
+            renderer.MarkupStart(tokens.GetMtype(i), tokens.GetPayload(i));
+            break;
+        case ntype::markup_end:
+            renderer.MarkupEnd(tokens.GetMtype(i), tokens.GetPayload(i));
+            break;
+        case ntype::text:
+            renderer.Text(tokens.GetPayload(i));
+            break;
+        case ntype::data:
+            renderer.Data(tokens.GetDataFormat(i), tokens.GetPayload(i));
+            break;
+        case ntype::verbatim:
+            renderer.Verbatim(tokens.GetPayload(i), tokens.GetFlags(i));
+            break;
+        }
+    }
+}
+
+/* Renders HTML, exactly like PodNode::ToHTML() does.
+ *
+ * After SetFragmentThreshold(), text, data and verbatim payloads of
+ * at least that many bytes are not copied into the result, but
+ * referred to. GetFragments() then returns the output as a list of
+ * pieces of the result and of the payloads, which write_fragments()
+ * writes out. The payloads belong to the token stream (or view) that
+ * was rendered, which therefore has to outlive the fragments.
+ *
+ * SetMeasuring() and SetOutputBuffer() switch to only counting the
+ * output and to writing it to memory of your own, respectively; see
+ * MeasureHTML(). */
+class PodHTMLRenderer: public PodRenderer<PodHTMLRenderer>
+{
+public:
+    PodHTMLRenderer(std::string (*fcb)(std::string), std::string (*mcb)(bool, std::string));
+
+    void HeadStart(int level, PodStringRef anchor);
+    void HeadEnd(int level);
+    void Over(OverListType t, PodStringRef indent);
+    void ItemStart(OverListType t, PodStringRef label);
+    void ItemEnd(OverListType t);
+    void Back(OverListType t);
+    void ParaStart();
+    void ParaEnd();
+    void MarkupStart(mtype t, PodStringRef link);
+    void MarkupEnd(mtype t, PodStringRef arg);
+    void Text(PodStringRef text);
+    void Data(PodStringRef format, PodStringRef data);
+    void Verbatim(PodStringRef text, size_t indent);
+
+    inline std::string& GetResult() { return m_result; }
+    inline void SetFragmentThreshold(size_t size) { m_fragment_threshold = size; }
+    std::vector<PodStringRef> GetFragments() const;
+    void SetMeasuring();
+    void SetOutputBuffer(char* p_buffer);
+    size_t GetSize() const;
+private:
+    enum class output { string, buffer, measure };
+
+    void put(const char* p_text, size_t size);
+    void put(const char* p_text);
+    void put(const std::string& text);
+    void add_payload(PodStringRef text);
+
+    std::string m_result;
+    std::string (*m_filename_cb)(std::string);
+    std::string (*m_mname_cb)(bool, std::string);
+    size_t m_fragment_threshold;
+    // Payloads left out of m_result, with the position they belong to
+    std::vector<std::pair<size_t, PodStringRef>> m_references;
+    output m_output;
+    char* mp_buffer;
+    size_t m_size; // Output so far unless it goes to m_result
+};
+
+// Renders plain text in lines of at most 76 characters. Lists and
+// verbatim paragraphs are indented, =begin text sections are copied.
+class PodTextRenderer: public PodRenderer<PodTextRenderer>
+{
+public:
+    PodTextRenderer();
+
+    void HeadEnd(int level);
+    void Over(OverListType t, PodStringRef indent);
+    void ItemStart(OverListType t, PodStringRef label);
+    void Back(OverListType t);
+    void ParaEnd();
+    void Text(PodStringRef text);
+    void Data(PodStringRef format, PodStringRef data);
+    void Verbatim(PodStringRef text, size_t indent);
+
+    inline std::string& GetResult() { return m_result; }
+private:
+    void add_block(const std::string& first_prefix, const std::string& prefix, const std::string& text);
+    void flush_bullet();
+
+    std::string m_result;
+    std::string m_inline;  // Text of the current paragraph or heading
+    std::string m_indent;  // Indentation of the current list level
+    std::string m_bullet;  // Label of the current =item, until used
+};
+
+// Renders CommonMark. Links are made the same way as for HTML;
+// =begin markdown and =begin html sections are copied.
+class PodMarkdownRenderer: public PodRenderer<PodMarkdownRenderer>
+{
+public:
+    PodMarkdownRenderer(std::string (*fcb)(std::string), std::string (*mcb)(bool, std::string));
+
+    void HeadEnd(int level);
+    void Over(OverListType t, PodStringRef indent);
+    void ItemStart(OverListType t, PodStringRef label);
+    void Back(OverListType t);
+    void ParaEnd();
+    void MarkupStart(mtype t, PodStringRef link);
+    void MarkupEnd(mtype t, PodStringRef arg);
+    void Text(PodStringRef text);
+    void Data(PodStringRef format, PodStringRef data);
+    void Verbatim(PodStringRef text, size_t indent);
+
+    inline std::string& GetResult() { return m_result; }
+private:
+    void add_block(const std::string& text);
+    void flush_bullet();
+
+    std::string m_result;
+    std::string m_inline;
+    std::vector<std::string> m_indents; // Per open list
+    std::string m_bullet;
+    std::vector<std::string> m_links;   // Targets of the open L<> codes
+    int m_code_level;
+    std::string (*m_filename_cb)(std::string);
+    std::string (*m_mname_cb)(bool, std::string);
+};
+
+// Renders the body of a man(7) page, without the .TH line.
+// =begin man and =begin roff sections are copied.
+class PodRoffRenderer: public PodRenderer<PodRoffRenderer>
+{
+public:
+    PodRoffRenderer();
+
+    void HeadEnd(int level);
+    void Over(OverListType t, PodStringRef indent);
+    void ItemStart(OverListType t, PodStringRef label);
+    void Back(OverListType t);
+    void ParaEnd();
+    void MarkupStart(mtype t, PodStringRef link);
+    void MarkupEnd(mtype t, PodStringRef arg);
+    void Text(PodStringRef text);
+    void Data(PodStringRef format, PodStringRef data);
+    void Verbatim(PodStringRef text, size_t indent);
+
+    inline std::string& GetResult() { return m_result; }
+private:
+    void add_line(const std::string& request);
+    void add_text(const std::string& text);
+
+    std::string m_result;
+    std::string m_inline;
+    std::vector<std::string> m_fonts; // Of the open formatting codes
+    std::vector<int> m_item_counts;   // Per open list
+    bool m_item_started;            // No .PP for the first paragraph
+};
+
+/* Builds a full-text search index of many documents from the
+ * terms PodTermRenderer collects. Serialize() merges the terms of
+ * all documents into one sorted table, which is used in place
+ * with PodSearchIndexView. */
+class PodSearchIndexBuilder
+{
+public:
+    // Adds a document and returns its number, i.e. the number
+    // of documents added before.
+    size_t AddDocument(const std::string& name, const std::unordered_map<std::string, unsigned int>& terms);
+    inline size_t GetDocumentCount() const { return m_names.size(); }
+    std::string Serialize() const;
+private:
+    std::vector<std::string> m_names;
+    // Per document, sorted by term
+    std::vector<std::vector<std::pair<std::string, unsigned int>>> m_terms;
+};
+
+/* Read-only access to a search index serialized with
+ * PodSearchIndexBuilder::Serialize(). Like PodTokenView, it uses the
+ * blob in place; it has to stay valid for the lifetime of the view
+ * and be aligned to 4 bytes. The constructor throws
+ * std::runtime_error if the blob is malformed.
+ *
+ * The terms are sorted bytewise. Each has a list of postings, i.e.
+ * the documents it occurs in together with its weight there,
+ * sorted by document. */
+class PodSearchIndexView
+{
+public:
+    static const uint32_t version = 1;
+
+    PodSearchIndexView(const void* p_blob, size_t size);
+
+    inline size_t GetDocumentCount() const { return m_doc_count; }
+    inline PodStringRef GetDocumentName(size_t doc) const { return text_ref(mp_docs + 2*doc); }
+    inline size_t GetTermCount() const { return m_term_count; }
+    inline PodStringRef GetTerm(size_t n) const { return text_ref(mp_terms + 4*n); }
+    // Returns the number of term `term', or std::string::npos if
+    // it is not in the index.
+    size_t FindTerm(const std::string& term) const;
+    inline size_t GetPostingCount(size_t n) const { return mp_terms[4*n + 3]; }
+    inline uint32_t GetPostingDocument(size_t n, size_t k) const { return mp_postings[2*(mp_terms[4*n + 2] + k)]; }
+    inline uint32_t GetPostingWeight(size_t n, size_t k) const { return mp_postings[2*(mp_terms[4*n + 2] + k) + 1]; }
+private:
+    inline PodStringRef text_ref(const uint32_t* p_ref) const { return PodStringRef(mp_text + p_ref[0], p_ref[1]); }
+
+    size_t m_doc_count;
+    size_t m_term_count;
+    const uint32_t* mp_docs;     // name offset, length
+    const uint32_t* mp_terms;    // text offset, length, first posting, posting count
+    const uint32_t* mp_postings; // document, weight
+    const char* mp_text;
+};
+
+// A heading as recorded by the parser. Headings of lower level
+// than their predecessors are nested into them; see
+// PodParser::GetOutline().
+struct PodHeading
+{
+    int level;
+    std::string text;   // Stripped of formatting codes
+    std::string anchor;
+    size_t first_token; // Index of the head_start token
+    size_t last_token;  // Index of the head_end token
+    size_t parent;      // Index of the enclosing heading, or std::string::npos
+};
+
+// Collects the headings of a document like PodParser::GetOutline()
+// does, except that `first_token' and `last_token' are not known and
+// set to std::string::npos.
+class PodTOCRenderer: public PodRenderer<PodTOCRenderer>
+{
+public:
+    PodTOCRenderer();
+
+    void HeadStart(int level, PodStringRef anchor);
+    void HeadEnd(int level);
+    void Text(PodStringRef text);
+
+    inline const std::vector<PodHeading>& GetOutline() const { return m_outline; }
+    // The table of contents as made by FormatTOC().
+    std::string GetResult() const;
+private:
+    std::vector<PodHeading> m_outline;
     std::string m_text;
+    bool m_in_heading;
+};
+
+// Collects the words of a document for a search index. Words are
+// made of ASCII letters, digits, "_" and all non-ASCII characters
+// and are lower-cased. Each occurrence of a word adds to its weight
+// depending on where it occurs.
+class PodTermRenderer: public PodRenderer<PodTermRenderer>
+{
+public:
+    enum : unsigned int {
+        body_weight    = 1,
+        code_weight    = 2, // C<> and verbatim paragraphs
+        heading_weight = 4,
+        index_weight   = 8  // X<>
+    };
+
+    PodTermRenderer();
+
+    void HeadStart(int level, PodStringRef anchor);
+    void HeadEnd(int level);
+    void ItemStart(OverListType t, PodStringRef label);
+    void ParaEnd();
+    void MarkupStart(mtype t, PodStringRef arg);
+    void MarkupEnd(mtype t, PodStringRef arg);
+    void Text(PodStringRef text);
+    void Verbatim(PodStringRef text, size_t indent);
+
+    // Returns the words with their weights.
+    inline const std::unordered_map<std::string, unsigned int>& GetTerms() const { return m_terms; }
+private:
+    void add_words(PodStringRef text, unsigned int weight);
+    void end_word();
+
+    std::unordered_map<std::string, unsigned int> m_terms;
+    std::string m_word; // May continue in the next text token
+    unsigned int m_word_weight;
+    int m_code_level;
+    bool m_in_heading;
+};
+
+/* Forwards every token to several renderers, so that all of them
+ * are fed by one pass over the tokens:
+ *
+ *     PodHTMLRenderer html(fcb, mcb);
+ *     PodTOCRenderer toc;
+ *     PodFanOutRenderer<PodHTMLRenderer, PodTOCRenderer> both(&html, &toc);
+ *     both.Render(parser.GetTokenStream());
+ *
+ * A null pointer disables the renderer at that position. As with
+ * PodRenderer, all calls are resolved at compile time. */
+template<typename... Renderers>
+class PodFanOutRenderer;
+
+template<>
+class PodFanOutRenderer<>: public PodRenderer<PodFanOutRenderer<>>
+{
+};
+
+template<typename First, typename... Rest>
+class PodFanOutRenderer<First, Rest...>: public PodRenderer<PodFanOutRenderer<First, Rest...>>
+{
+public:
+    PodFanOutRenderer(First* p_first, Rest*... p_rest) : mp_first(p_first), m_rest(p_rest...) {}
+
+    inline void HeadStart(int level, PodStringRef anchor) { if (mp_first) mp_first->HeadStart(level, anchor); m_rest.HeadStart(level, anchor); }
+    inline void HeadEnd(int level) { if (mp_first) mp_first->HeadEnd(level); m_rest.HeadEnd(level); }
+    inline void Over(OverListType t, PodStringRef indent) { if (mp_first) mp_first->Over(t, indent); m_rest.Over(t, indent); }
+    inline void ItemStart(OverListType t, PodStringRef label) { if (mp_first) mp_first->ItemStart(t, label); m_rest.ItemStart(t, label); }
+    inline void ItemEnd(OverListType t) { if (mp_first) mp_first->ItemEnd(t); m_rest.ItemEnd(t); }
+    inline void Back(OverListType t) { if (mp_first) mp_first->Back(t); m_rest.Back(t); }
+    inline void ParaStart() { if (mp_first) mp_first->ParaStart(); m_rest.ParaStart(); }
+    inline void ParaEnd() { if (mp_first) mp_first->ParaEnd(); m_rest.ParaEnd(); }
+    inline void MarkupStart(mtype t, PodStringRef link) { if (mp_first) mp_first->MarkupStart(t, link); m_rest.MarkupStart(t, link); }
+    inline void MarkupEnd(mtype t, PodStringRef arg) { if (mp_first) mp_first->MarkupEnd(t, arg); m_rest.MarkupEnd(t, arg); }
+    inline void Text(PodStringRef text) { if (mp_first) mp_first->Text(text); m_rest.Text(text); }
+    inline void Data(PodStringRef format, PodStringRef data) { if (mp_first) mp_first->Data(format, data); m_rest.Data(format, data); }
+    inline void Verbatim(PodStringRef text, size_t indent) { if (mp_first) mp_first->Verbatim(text, indent); m_rest.Verbatim(text, indent); }
+private:
+    First* mp_first;
+    PodFanOutRenderer<Rest...> m_rest;
+};
+
+// An L<> link as recorded by the parser; `target' is the part
+// after the bar, if any, as written in the document. `line' and
+// `column' are those of the closing angle bracket, see PodDiagnostic.
+struct PodLink
+{
+    std::string target;
+    long line;
+    long column;
+};
+
+enum class LinkKind {
+    url,             // L<https://...>
+    manpage,         // L<tsc(6)>
+    document,        // L<Object>
+    section,         // L<Object/Section> or L</Section>
+    class_method,    // L<Object::cmethod> or L<::cmethod>
+    instance_method  // L<Object#imethod> or L<#imethod>
+};
+
+// A link target split into its parts by parse_link_target().
+// `document' is empty for links into the same document. `name'
+// is the URL, the section, the method name or the manpage's
+// section, depending on `kind'; for manpages, `document' is the
+// manpage's name.
+struct PodLinkTarget
+{
+    LinkKind kind;
+    std::string document;
+    std::string name;
+};
+
+enum class DiagnosticSeverity {
+    info,
+    warning,
+    error
+};
+
+// Every diagnostic the parser can issue. The numeric values are
+// stable and may be used for filtering in user code.
+enum class DiagnosticCode {
+    empty_over = 1,            // =back without any =item
+    for_lacks_argument,        // =for without format name
+    encoding_ignored,          // =encoding is not supported
+    unknown_command,           // =foo
+    invalid_command,           // bare "=" or =begin without identifier
+    invalid_over_indent,       // =over with non-numeric indent
+    code_inside_zap,           // Z<B<...>>
+    code_inside_escape,        // E<B<...>>
+    code_inside_index,         // X<B<...>>
+    code_inside_link_target,   // L<text|B<...>>
+    unknown_formatting_code,   // Q<...>
+    markup_in_link_target,     // L<text|a < b>
+    empty_link_target,         // L</>
+    unknown_escape_code,       // E<foo>
+    unterminated_data          // =begin without =end
+};
+
+// One diagnostic message issued by the parser. `line' is
+// 1-based; `column' is the 1-based byte offset into that line,
+// or 0 if the column cannot be determined.
+struct PodDiagnostic
+{
+    DiagnosticCode code;
+    DiagnosticSeverity severity;
+    long line;
+    long column;
+    std::string message;
 };
 
 class PodParser
@@ -211,25 +922,120 @@ public:
     ~PodParser();
 
     void Reset(const std::string& str);
+    void SetRetainedCapacity(size_t bytes);
+    void SetLazyInline(bool lazy);
     void Parse();
-    inline const std::vector<PodNode*>& GetTokens() { return m_tokens; };
+    void ParseInline();
+    void Scan();
+    // In lazy mode: whether the paragraph starting with para_start
+    // token `token' is not parsed yet, and its tokens.
+    bool IsPending(size_t token) const;
+    const PodTokenStream& ParseParagraph(size_t token);
+    // The parsed document in compact form.
+    inline const PodTokenStream& GetTokenStream() const { return m_stream; }
+    // The parsed document as PodNode instances, which are created
+    // from the token stream on the first call. They remain owned by
+    // the parser. In lazy mode, ParseInline() is called first.
+    const std::vector<PodNode*>& GetTokens();
     // Returns the found X<> index entries as a map of form:
     // "index heading" => "insert_anchor_name"
     inline const std::map<std::string, std::string> GetIndexEntries() const { return m_idx_keywords; }
+    // Returns the anchors of the headings as a map of form:
+    // "heading text" => "anchor_name". The heading text is stripped
+    // of formatting codes. Of headings with equal text, the first
+    // one is listed.
+    inline const std::unordered_map<std::string, std::string>& GetHeadingAnchors() const { return m_heading_anchors; }
+    // Returns all headings in document order.
+    inline const std::vector<PodHeading>& GetOutline() const { return m_outline; }
+    // Returns all L<> links in document order.
+    inline const std::vector<PodLink>& GetLinks() const { return m_links; }
+    // Returns the labels of all =item entries in document order,
+    // as FindSection() knows them; unlabelled items are left out.
+    std::vector<std::string> GetItemLabels() const;
+    // Returns the first ordinary paragraph of the NAME section stripped
+    // of formatting codes, e.g. "Foo::Bar - frobnicate the bar".
+    std::string GetAbstract();
+    // Finds the tokens [first, last) of the section RenderSection()
+    // renders for `name'. Returns false if there is no such section.
+    // The sections are indexed on the first call.
+    bool FindSection(const std::string& name, size_t& first, size_t& last);
+    std::string RenderSection(const std::string& name);
+    std::string Serialize() const;
+
+    // Diagnostics are collected into the vector returned by
+    // GetDiagnostics() unless a callback is set, in which case
+    // they are handed to the callback instead.
+    void SetDiagnosticCallback(void (*cb)(const PodDiagnostic&, void*), void* p_userdata = nullptr);
+    void SetMinimumSeverity(DiagnosticSeverity severity);
+    void SetDiagnosticLimit(unsigned int limit);
+    inline const std::vector<PodDiagnostic>& GetDiagnostics() const { return m_diagnostics; }
+    inline size_t GetSuppressedDiagnosticsCount() const { return m_diag_suppressed; }
 
     static std::string MakeHeadingAnchorName(const std::string& title);
 private:
-    void parse_line(const std::string& line);
-    void parse_command(std::string command);
-    void parse_ordinary(std::string ordinary);
-    void parse_verbatim(std::string verbatim);
-    void parse_data(std::string data);
-    void parse_inline(std::string para);
-    PodNodeItemStart* find_preceeding_item();
-    PodNodeOver* find_preceeding_over();
-    PodNodeInlineMarkupStart* find_preceeding_inline_markup_start(mtype t);
+    // An open formatting code while parsing inline markup
+    struct markup_element {
+        size_t angle_count;
+        mtype type;
+    };
+
+    // A part of the document RenderSection() renders: the tokens
+    // [first_token, last_token), which are inside the list or item
+    // m_blocks[enclosing] (std::string::npos if none).
+    struct section {
+        size_t first_token;
+        size_t last_token;
+        size_t enclosing;
+    };
+
+    // An ordinary paragraph whose inline markup is parsed later, in
+    // lazy mode: the paragraph's para_start token and where it is in
+    // the source. `length' is that of m_current_buffer for it,
+    // `diagnostics' the number of m_diagnostics issued before it.
+    struct pending_paragraph {
+        size_t token;
+        size_t source_offset;
+        size_t length;
+        long line;
+        size_t diagnostics;
+    };
+
+    // An =over or =item, which is inside m_blocks[parent]
+    struct block {
+        size_t token;
+        size_t parent;
+    };
+
+    void parse_line(PodStringRef line);
+    void buffer_line(PodStringRef line, char eol);
+    void clear_buffer();
+    size_t source_offset(size_t bufpos);
+    void parse_command(const std::string& command);
+    void parse_ordinary(const std::string& ordinary);
+    void parse_verbatim(const std::string& verbatim);
+    size_t parse_data(size_t start);
+    void parse_inline(const std::string& para, size_t offset = std::string::npos);
+    void add_text(const std::string& text, size_t source_offset = std::string::npos);
+    std::string item_label(size_t token) const;
+    std::string register_anchor(const std::string& title);
+    void resolve_section_links();
+    void resolve_section_link(PodTokenStream& stream, size_t token) const;
+    void index_sections();
+    std::vector<pending_paragraph>::const_iterator find_pending(size_t token) const;
+    void load_pending(const pending_paragraph& paragraph);
+    void limit_diagnostics();
+    void add_markup_start(mtype t);
+    void add_markup_end(mtype t, const std::string& arg = std::string());
+    size_t find_preceeding_item();
+    size_t find_preceeding_over();
+    size_t find_preceeding_inline_markup_start(mtype t);
     bool is_inline_mode_active(mtype t);
-    void zap_tokens();
+    void zap_tokens(size_t first);
+    void check_link_target(size_t bufpos);
+    void add_link(size_t bufpos);
+    void buffer_position(size_t bufpos, long& line, long& column);
+    bool diagnostic_wanted(DiagnosticCode code);
+    void diagnose(DiagnosticCode code, size_t bufpos, const std::string& message);
 
     enum class mode {
         none,
@@ -243,26 +1049,119 @@ private:
     long m_lino;
     mode m_mode;
     bool m_link_bar_found;
-    std::string m_source_markup;
     std::string (*m_filename_cb)(std::string);
     std::string (*m_mname_cb)(bool, std::string);
     size_t m_verbatim_lead_space;
+    PodTokenStream m_stream;
     std::vector<PodNode*> m_tokens;
+    // Number of currently open formatting codes per mtype,
+    // i.e. starts minus ends in m_stream.
+    long m_open_markup[static_cast<int>(mtype::link) + 1];
     std::string m_current_buffer;
     std::string m_data_end_tag;
     std::vector<std::string> m_data_args;
     std::map<std::string, std::string> m_idx_keywords;
+    std::unordered_map<std::string, std::string> m_heading_anchors;
+    std::unordered_set<std::string> m_anchors; // All anchors in use
+    std::vector<PodHeading> m_outline;
+    std::vector<PodLink> m_links;
+    std::vector<section> m_sections;
+    std::vector<block> m_blocks;
+    // Sections by heading anchor and by =item label, see index_sections()
+    std::unordered_map<std::string, size_t> m_heading_sections;
+    std::unordered_map<std::string, size_t> m_item_sections;
+    bool m_sections_indexed;
+
+    // Lazy mode: the ordinary paragraphs not parsed yet, in order.
+    // When one is asked for alone, its tokens are parsed into
+    // m_scratch_stream, without recording diagnostics, links and
+    // index entries.
+    bool m_lazy_inline;
+    std::vector<pending_paragraph> m_pending;
+    PodTokenStream m_scratch_stream;
+    bool m_scratch_parse;
+
+    // Scan(): the document, while the parser works on the
+    // paragraphs taken from it.
+    bool m_scanning;
+    std::string m_scan_source;
+
     std::string m_ecode;
     std::string m_idx_kw;
     std::string m_link_content;
+
+    // Scratch space of parse_command() and parse_inline(), kept
+    // for the next paragraph (and document, see Reset()).
+    std::vector<std::string> m_arguments;
+    std::string m_inline_buffer;
+    std::string m_inline_text;
+    std::vector<markup_element> m_inline_stack;
+    std::vector<uint64_t> m_inline_bits; // See mark_structural()
+    size_t m_retained_capacity;
+
+    // Position tracking: source offset of the current line, line
+    // number of the first line in m_current_buffer, and for each line
+    // in m_current_buffer the offsets it starts at in the buffer and
+    // in the source.
+    size_t m_line_offset;
+    long m_para_lino;
+    std::vector<size_t> m_para_line_offsets;
+    std::vector<size_t> m_para_source_offsets;
+
+    void (*m_diag_cb)(const PodDiagnostic&, void*);
+    void* m_diag_userdata;
+    DiagnosticSeverity m_diag_min_severity;
+    unsigned int m_diag_limit;
+    std::map<DiagnosticCode, unsigned int> m_diag_counts;
+    size_t m_diag_suppressed;
+    PodDiagnostic m_last_diagnostic;
+    std::vector<PodDiagnostic> m_diagnostics;
 };
 
 /// A function that calls ToHTML() on each token in `tokens',
 /// acculumates the results and returns them as one string.
 std::string FormatHTML(const std::vector<PodNode*>& tokens);
+/// Same as above, but renders the compact token stream directly
+/// without creating any PodNode instances.
+std::string FormatHTML(const PodTokenStream& stream);
+/// Same as above for a serialized token stream. As callbacks cannot
+/// be serialized, they have to be passed again.
+std::string FormatHTML(const PodTokenView& view,
+                       std::string (*fcb)(std::string),
+                       std::string (*mcb)(bool, std::string));
+/// Same as FormatHTML(), but a large document is split into parts at
+/// headings and paragraph ends, which are rendered on up to `jobs'
+/// threads (0 for one per CPU). The callbacks must be safe to call
+/// from several threads at once.
+std::string FormatHTMLParallel(const std::vector<PodNode*>& tokens, unsigned int jobs = 0);
+std::string FormatHTMLParallel(const PodTokenStream& stream, unsigned int jobs = 0);
+/// The exact number of bytes FormatHTML() produces for `stream'.
+size_t MeasureHTML(const PodTokenStream& stream);
+/// Writes the HTML for `stream' to `p_buffer', which must hold at
+/// least MeasureHTML() bytes, and returns the end of what was written.
+char* FormatHTML(const PodTokenStream& stream, char* p_buffer);
+/// The token stream as plain text, see PodTextRenderer.
+std::string FormatText(const PodTokenStream& stream);
+/// The token stream as Markdown, see PodMarkdownRenderer.
+std::string FormatMarkdown(const PodTokenStream& stream);
+/// The token stream as man page body, see PodRoffRenderer.
+std::string FormatRoff(const PodTokenStream& stream);
+/// Renders the outline as returned by PodParser::GetOutline() as
+/// nested lists of links to the headings.
+std::string FormatTOC(const std::vector<PodHeading>& outline);
 
+// Writes all of `fragments' to file descriptor `fd' with as few
+// writev(2) calls as possible. Returns false with errno set if
+// that fails.
+bool write_fragments(int fd, const std::vector<PodStringRef>& fragments);
 // Counts the leading spaces and tabs in +str+.
-size_t count_leading_whitespace(const std::string& str);
+size_t count_leading_whitespace(PodStringRef str);
+// Appends the lines of `text' to `result', each with up to `indent'
+// characters of leading white space removed.
+void append_unindented(std::string& result, PodStringRef text, size_t indent);
+// Appends `text' to `result', with the HTML entities html_escape()
+// makes turned back into characters; &nbsp; becomes U+00A0.
+void append_unescaped(std::string& result, PodStringRef text);
 // Joins all the strings in `vec' into one string separated by `separator'.
 std::string join_vectorstr(const std::vector<std::string>& vec, const std::string& separator);
 // Mask all occurences of &, <, and >. If `nbsp' is
@@ -277,6 +1176,18 @@ void html_escape(std::string& str, bool nbsp = false);
  *
  * FIXME: Ignores manpages with unusual letter sections (e.g. 3p) */
 bool check_manpage(const std::string& target, std::string& manpage, std::string& section);
+// Classifies the link target `target' of an L<> code (the part after
+// the bar, if any) the way it is rendered as HTML.
+PodLinkTarget parse_link_target(const std::string& target);
+/* Resolves the code of an E<> formatting code, which is either an
+ * HTML5 entity name, one of the POD names "verbar", "sol",
+ * "lchevron" and "rchevron", or a decimal, hexadecimal (0x...) or
+ * octal (0...) Unicode code point. If valid, `utf8' is set to the
+ * UTF-8 encoded character(s) and true is returned. */
+bool resolve_escape_code(const std::string& ecode, std::string& utf8);
+// Formats `diag' the way the parser used to print warnings, e.g.
+// "Warning on line 3, column 5: Ignoring unknown command 'foo'".
+std::string format_diagnostic(const PodDiagnostic& diag);
 
 }
 
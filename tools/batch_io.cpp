@@ -0,0 +1,493 @@
+/* Batched file I/O for pod2html.
+ *
+ * Copyright © 2019 Marvin Gülker
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "batch_io.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef BATCH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace Pod;
+
+// Entries of the submission queue. A batch of pod2html needs four
+// per document at most; more than this are submitted in several
+// rounds.
+static const unsigned int s_ring_entries = 256;
+
+// Creates all missing directories leading to file `path'.
+static bool make_parent_dirs(const std::string& path)
+{
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+// Opens the temporary file of `request', creating its directory
+// if needed.
+static int open_tmpfile(const write_request& request)
+{
+    int fd = open(request.tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT && make_parent_dirs(request.path))
+        fd = open(request.tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    return fd;
+}
+
+static void read_file(read_request& request)
+{
+    int fd = open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        request.error = errno;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    request.content.resize(st.st_size);
+    size_t done = 0;
+    while (done < request.content.size()) {
+        ssize_t count = pread(fd, &request.content[done], request.content.size() - done, done);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0) {
+            request.error = errno;
+            break;
+        }
+        if (count == 0) // The file got shorter
+            break;
+        done += count;
+    }
+    request.content.resize(done);
+    close(fd);
+}
+
+// Writes the temporary file from the start and renames it. `fd' is
+// the open temporary file, or -1.
+static void write_file(write_request& request, int fd)
+{
+    if (fd < 0)
+        fd = open_tmpfile(request);
+    if (fd < 0) {
+        request.error = errno;
+        return;
+    }
+
+    bool ok = write_fragments(fd, request.content);
+    if (close(fd) != 0)
+        ok = false;
+    if (!ok || rename(request.tmppath.c_str(), request.path.c_str()) != 0) {
+        request.error = errno;
+        unlink(request.tmppath.c_str());
+    }
+}
+
+batch_io::batch_io(bool use_uring)
+    : m_ring_fd(-1),
+      m_pending(0),
+      mp_sq_ring(nullptr),
+      m_sq_ring_size(0),
+      mp_cq_ring(nullptr),
+      m_cq_ring_size(0),
+      mp_sqes(nullptr),
+      m_sqes_size(0)
+{
+    if (use_uring && !setup_ring() && m_ring_fd >= 0) {
+        close(m_ring_fd);
+        m_ring_fd = -1;
+    }
+}
+
+batch_io::~batch_io()
+{
+#ifdef BATCH_IO_URING
+    if (mp_sqes)
+        munmap(mp_sqes, m_sqes_size);
+    if (mp_cq_ring && mp_cq_ring != mp_sq_ring)
+        munmap(mp_cq_ring, m_cq_ring_size);
+    if (mp_sq_ring)
+        munmap(mp_sq_ring, m_sq_ring_size);
+#endif
+    if (m_ring_fd >= 0)
+        close(m_ring_fd);
+}
+
+#ifdef BATCH_IO_URING
+
+// Sets up the ring if the kernel has it and supports all operations
+// needed. On failure, the ring is left for the destructor.
+bool batch_io::setup_ring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_ring_fd = syscall(__NR_io_uring_setup, s_ring_entries, &params);
+    if (m_ring_fd < 0)
+        return false;
+
+    // Older kernels lack some of the operations
+    static const unsigned char required[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                                             IORING_OP_WRITEV, IORING_OP_CLOSE, IORING_OP_RENAMEAT};
+    std::vector<char> probe_buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* p_probe = reinterpret_cast<struct io_uring_probe*>(probe_buffer.data());
+    if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PROBE, p_probe, 256) < 0)
+        return false;
+    for (unsigned char op: required) {
+        if (op > p_probe->last_op || !(p_probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    }
+
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+    void* p_map = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (p_map == MAP_FAILED)
+        return false;
+    mp_sq_ring = p_map;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        mp_cq_ring = mp_sq_ring;
+    else {
+        p_map = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+        if (p_map == MAP_FAILED)
+            return false;
+        mp_cq_ring = p_map;
+    }
+
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    p_map = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (p_map == MAP_FAILED)
+        return false;
+    mp_sqes = p_map;
+
+    char* p_sq = static_cast<char*>(mp_sq_ring);
+    char* p_cq = static_cast<char*>(mp_cq_ring);
+    mp_sq_head  = reinterpret_cast<unsigned int*>(p_sq + params.sq_off.head);
+    mp_sq_tail  = reinterpret_cast<unsigned int*>(p_sq + params.sq_off.tail);
+    mp_sq_array = reinterpret_cast<unsigned int*>(p_sq + params.sq_off.array);
+    m_sq_mask   = *reinterpret_cast<unsigned int*>(p_sq + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    mp_cq_head  = reinterpret_cast<unsigned int*>(p_cq + params.cq_off.head);
+    mp_cq_tail  = reinterpret_cast<unsigned int*>(p_cq + params.cq_off.tail);
+    m_cq_mask   = *reinterpret_cast<unsigned int*>(p_cq + params.cq_off.ring_mask);
+    mp_cqes     = p_cq + params.cq_off.cqes;
+    return true;
+}
+
+// Submits the queue unless there is room for `count' more entries.
+// Linked entries must be submitted together.
+void batch_io::make_room(unsigned int count)
+{
+    if (m_pending + count > m_sq_entries)
+        submit();
+}
+
+// Returns a cleared submission queue entry whose completion is
+// stored in `op'. Submits the queue first if it is full.
+void* batch_io::get_sqe(io_operation& op)
+{
+    make_room(1);
+
+    unsigned int tail = *mp_sq_tail;
+    unsigned int index = tail & m_sq_mask;
+    struct io_uring_sqe* p_sqe = static_cast<struct io_uring_sqe*>(mp_sqes) + index;
+    memset(p_sqe, 0, sizeof(*p_sqe));
+    p_sqe->user_data = reinterpret_cast<uintptr_t>(&op);
+    mp_sq_array[index] = index;
+    __atomic_store_n(mp_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    op.done = false;
+    m_pending++;
+    return p_sqe;
+}
+
+void batch_io::submit()
+{
+    while (m_pending > 0) {
+        long count = syscall(__NR_io_uring_enter, m_ring_fd, m_pending, 0, 0, nullptr, 0);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EBUSY) // Completion queue full
+                reap();
+            else if (errno != EINTR)
+                return;
+            continue;
+        }
+        m_pending -= count;
+    }
+}
+
+// Stores all completions that are there in their operations.
+void batch_io::reap()
+{
+    unsigned int head = *mp_cq_head;
+    unsigned int tail = __atomic_load_n(mp_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* p_cqe = static_cast<const struct io_uring_cqe*>(mp_cqes) + (head & m_cq_mask);
+        io_operation* p_op = reinterpret_cast<io_operation*>(static_cast<uintptr_t>(p_cqe->user_data));
+        p_op->result = p_cqe->res;
+        p_op->done = true;
+    }
+    __atomic_store_n(mp_cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Waits for `op' to complete. If the ring fails, `op' gets the
+// error as its result.
+void batch_io::wait(io_operation& op)
+{
+    submit();
+    reap();
+    while (!op.done) {
+        if (syscall(__NR_io_uring_enter, m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+            op.result = -errno;
+            return;
+        }
+        reap();
+    }
+}
+
+/**
+ * Opens the files of `requests' and looks up their sizes. The
+ * reading itself is done by finish_reads(), so the requests must
+ * not be moved in between. Without a ring, this does nothing.
+ */
+void batch_io::start_reads(std::vector<read_request>& requests)
+{
+    if (!uses_uring())
+        return;
+
+    for (read_request& request: requests) {
+        struct io_uring_sqe* p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.open_op));
+        p_sqe->opcode = IORING_OP_OPENAT;
+        p_sqe->fd = AT_FDCWD;
+        p_sqe->addr = reinterpret_cast<uintptr_t>(request.path.c_str());
+        p_sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.stat_op));
+        p_sqe->opcode = IORING_OP_STATX;
+        p_sqe->fd = AT_FDCWD;
+        p_sqe->addr = reinterpret_cast<uintptr_t>(request.path.c_str());
+        p_sqe->len = STATX_SIZE;
+        p_sqe->off = reinterpret_cast<uintptr_t>(&request.stat);
+    }
+    submit();
+}
+
+/// Reads the files of `requests' started with start_reads().
+void batch_io::finish_reads(std::vector<read_request>& requests)
+{
+    if (!uses_uring()) {
+        for (read_request& request: requests) {
+            read_file(request);
+        }
+        return;
+    }
+
+    // Each read is hard-linked to the closing of the file, so
+    // the file is closed even if reading fails.
+    for (read_request& request: requests) {
+        wait(request.open_op);
+        wait(request.stat_op);
+        if (request.open_op.result < 0) {
+            request.error = -request.open_op.result;
+            continue;
+        }
+        request.fd = request.open_op.result;
+        request.content.resize(request.stat_op.result < 0 ? 0 : request.stat.stx_size);
+
+        make_room(2);
+        struct io_uring_sqe* p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.read_op));
+        p_sqe->opcode = IORING_OP_READ;
+        p_sqe->flags = IOSQE_IO_HARDLINK;
+        p_sqe->fd = request.fd;
+        p_sqe->addr = reinterpret_cast<uintptr_t>(&request.content[0]);
+        p_sqe->len = request.content.size();
+
+        p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.close_op));
+        p_sqe->opcode = IORING_OP_CLOSE;
+        p_sqe->fd = request.fd;
+    }
+    submit();
+
+    for (read_request& request: requests) {
+        if (request.fd < 0)
+            continue;
+
+        wait(request.read_op);
+        wait(request.close_op);
+        request.fd = -1;
+        if (request.stat_op.result < 0)
+            request.error = -request.stat_op.result;
+        else if (request.read_op.result < 0)
+            request.error = -request.read_op.result;
+        else
+            request.content.resize(request.read_op.result);
+    }
+}
+
+/**
+ * Writes all of `requests', each to a temporary file that is then
+ * renamed. In the ring, all files are opened at once, then written
+ * and closed, then renamed. Writes that come out short are done
+ * again with one system call each.
+ */
+void batch_io::write_files(std::vector<write_request>& requests)
+{
+    if (!uses_uring()) {
+        for (write_request& request: requests) {
+            request.tmppath = request.path + ".tmp";
+            write_file(request, -1);
+        }
+        return;
+    }
+
+    for (write_request& request: requests) {
+        request.tmppath = request.path + ".tmp";
+        struct io_uring_sqe* p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.open_op));
+        p_sqe->opcode = IORING_OP_OPENAT;
+        p_sqe->fd = AT_FDCWD;
+        p_sqe->addr = reinterpret_cast<uintptr_t>(request.tmppath.c_str());
+        p_sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        p_sqe->len = 0666;
+    }
+    submit();
+
+    for (write_request& request: requests) {
+        wait(request.open_op);
+        request.fd = request.open_op.result;
+        if (request.fd < 0) {
+            if (request.fd == -ENOENT) // The directory is missing
+                request.fd = open_tmpfile(request);
+            else
+                errno = -request.fd;
+        }
+        if (request.fd < 0) {
+            request.error = errno;
+            continue;
+        }
+
+        request.size = 0;
+        request.iov.resize(request.content.size());
+        for (size_t i=0; i < request.content.size(); i++) {
+            request.iov[i].iov_base = const_cast<char*>(request.content[i].Data());
+            request.iov[i].iov_len  = request.content[i].Size();
+            request.size += request.content[i].Size();
+        }
+        if (request.iov.size() > IOV_MAX || request.size > INT_MAX) { // Too much for one writev()
+            write_file(request, request.fd);
+            request.fd = -1;
+            continue;
+        }
+
+        make_room(2);
+        struct io_uring_sqe* p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.write_op));
+        p_sqe->opcode = IORING_OP_WRITEV;
+        p_sqe->flags = IOSQE_IO_HARDLINK;
+        p_sqe->fd = request.fd;
+        p_sqe->addr = reinterpret_cast<uintptr_t>(request.iov.data());
+        p_sqe->len = request.iov.size();
+
+        p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.close_op));
+        p_sqe->opcode = IORING_OP_CLOSE;
+        p_sqe->fd = request.fd;
+    }
+    submit();
+
+    for (write_request& request: requests) {
+        if (request.fd < 0)
+            continue;
+
+        wait(request.write_op);
+        wait(request.close_op);
+        if (request.write_op.result >= 0 && static_cast<size_t>(request.write_op.result) == request.size && request.close_op.result == 0) {
+            struct io_uring_sqe* p_sqe = static_cast<struct io_uring_sqe*>(get_sqe(request.rename_op));
+            p_sqe->opcode = IORING_OP_RENAMEAT;
+            p_sqe->fd = AT_FDCWD;
+            p_sqe->addr = reinterpret_cast<uintptr_t>(request.tmppath.c_str());
+            p_sqe->len = AT_FDCWD;
+            p_sqe->addr2 = reinterpret_cast<uintptr_t>(request.path.c_str());
+        }
+        else {
+            write_file(request, -1);
+            request.fd = -1;
+        }
+    }
+    submit();
+
+    for (write_request& request: requests) {
+        if (request.fd < 0)
+            continue;
+
+        wait(request.rename_op);
+        request.fd = -1;
+        if (request.rename_op.result < 0) {
+            request.error = -request.rename_op.result;
+            unlink(request.tmppath.c_str());
+        }
+    }
+}
+
+#else // No io_uring, only the fallback
+
+bool batch_io::setup_ring()
+{
+    return false;
+}
+
+void batch_io::start_reads(std::vector<read_request>&)
+{
+}
+
+void batch_io::finish_reads(std::vector<read_request>& requests)
+{
+    for (read_request& request: requests) {
+        read_file(request);
+    }
+}
+
+void batch_io::write_files(std::vector<write_request>& requests)
+{
+    for (write_request& request: requests) {
+        request.tmppath = request.path + ".tmp";
+        write_file(request, -1);
+    }
+}
+
+#endif
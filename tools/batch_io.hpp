@@ -0,0 +1,146 @@
+/* Batched file I/O for pod2html.
+ *
+ * Copyright © 2019 Marvin Gülker
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POD2HTML_BATCH_IO_HPP
+#define POD2HTML_BATCH_IO_HPP
+#include "../pod.hpp"
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BATCH_IO_URING 1
+#endif
+#endif
+
+// One operation submitted to the ring; `user_data' points to it.
+// `result' is a negative errno value until it completes.
+struct io_operation {
+    io_operation() : result(-EIO), done(false) {}
+
+    int result;
+    bool done;
+};
+
+// A file to be read completely into `content'. `error' is the errno
+// value if that failed, or 0.
+struct read_request {
+    explicit read_request(const std::string& p) : path(p), error(0), fd(-1) {}
+
+    std::string path;
+    std::string content;
+    int error;
+
+    // Internal state while the request is in flight
+    int fd;
+#ifdef BATCH_IO_URING
+    struct statx stat;
+#endif
+    io_operation open_op;
+    io_operation stat_op;
+    io_operation read_op;
+    io_operation close_op;
+};
+
+// A file to be replaced by the concatenation of `content'. It is
+// written to "path.tmp" first and then renamed. `error' is the errno
+// value if that failed, or 0.
+struct write_request {
+    write_request(const std::string& p, const std::vector<Pod::PodStringRef>& c) : path(p), content(c), error(0), fd(-1) {}
+
+    std::string path;
+    std::vector<Pod::PodStringRef> content;
+    int error;
+
+    // Internal state while the request is in flight
+    std::string tmppath;
+    std::vector<struct iovec> iov;
+    size_t size;
+    int fd;
+    io_operation open_op;
+    io_operation write_op;
+    io_operation close_op;
+    io_operation rename_op;
+};
+
+/* Reads and writes many files with few system calls. Each thread
+ * needs an instance of its own.
+ *
+ * This uses an io_uring where the kernel supports all of the
+ * operations needed, and one system call per operation otherwise.
+ * Requests must stay where they are between start_reads() and
+ * finish_reads(). */
+class batch_io
+{
+public:
+    explicit batch_io(bool use_uring = true);
+    ~batch_io();
+
+    inline bool uses_uring() const { return m_ring_fd >= 0; }
+
+    void start_reads(std::vector<read_request>& requests);
+    void finish_reads(std::vector<read_request>& requests);
+    void write_files(std::vector<write_request>& requests);
+private:
+    batch_io(const batch_io&) = delete;
+    batch_io& operator=(const batch_io&) = delete;
+
+    bool setup_ring();
+    void make_room(unsigned int count);
+    void* get_sqe(io_operation& op);
+    void submit();
+    void reap();
+    void wait(io_operation& op);
+
+    int m_ring_fd;
+    unsigned int m_pending; // SQEs not yet submitted
+
+    void* mp_sq_ring;
+    size_t m_sq_ring_size;
+    void* mp_cq_ring;
+    size_t m_cq_ring_size;
+    void* mp_sqes;
+    size_t m_sqes_size;
+
+    unsigned int* mp_sq_head;
+    unsigned int* mp_sq_tail;
+    unsigned int* mp_sq_array;
+    unsigned int m_sq_mask;
+    unsigned int m_sq_entries;
+    unsigned int* mp_cq_head;
+    unsigned int* mp_cq_tail;
+    unsigned int m_cq_mask;
+    void* mp_cqes;
+};
+
+#endif
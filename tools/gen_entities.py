@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Copyright © 2019 Marvin Gülker
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above
+#    copyright notice, this list of conditions and the following
+#    disclaimer in the documentation and/or other materials provided
+#    with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+# INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+# OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generates pod_entities.inc, the table of E<> escape codes: all
+# HTML5 named character references plus the POD-specific ones. The
+# table is addressed by a perfect hash ("hash and displace"): the
+# first hash of a name selects a bucket, whose displacement is used
+# as the basis of the second hash that selects the table slot. The
+# hash function must match entity_hash() in pod.cpp.
+#
+# Usage: tools/gen_entities.py > pod_entities.inc
+
+import html.entities
+
+FNV_BASIS = 2166136261
+FNV_PRIME = 16777619
+SLOTS = 4096 # power of two
+
+def entity_hash(name, basis):
+    h = basis
+    for ch in name.encode("ascii"):
+        h = ((h ^ ch) * FNV_PRIME) & 0xffffffff
+    return h
+
+def c_string(s):
+    return '"' + "".join("\\x%02x" % b for b in s.encode("utf-8")) + '"'
+
+def main():
+    entities = {}
+    for name, value in html.entities.html5.items():
+        entities[name.rstrip(";")] = value
+    # perlpod(1) names that HTML does not have
+    entities["verbar"] = "|"
+    entities["sol"] = "/"
+    entities["lchevron"] = "«"
+    entities["rchevron"] = "»"
+
+    names = sorted(entities)
+    nbuckets = len(names) // 4 + 1
+    buckets = [[] for _ in range(nbuckets)]
+    for name in names:
+        buckets[entity_hash(name, FNV_BASIS) % nbuckets].append(name)
+
+    slots = [None] * SLOTS
+    displacements = [0] * nbuckets
+    for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+        if not buckets[b]:
+            continue
+        d = 1
+        while True:
+            wanted = set(entity_hash(n, FNV_BASIS ^ d) & (SLOTS - 1) for n in buckets[b])
+            if len(wanted) == len(buckets[b]) and all(slots[s] is None for s in wanted):
+                break
+            d += 1
+        displacements[b] = d
+        for n in buckets[b]:
+            slots[entity_hash(n, FNV_BASIS ^ d) & (SLOTS - 1)] = n
+
+    index = {name: i for i, name in enumerate(names)}
+
+    print("/* Generated by tools/gen_entities.py -- do not edit. */")
+    print()
+    print("static const size_t s_entity_buckets = %d;" % nbuckets)
+    print("static const size_t s_entity_slots = %d;" % SLOTS)
+    print()
+    print("// The C++ and Python hash functions have to agree.")
+    print("static_assert(entity_hash(\"amp\", 3, s_entity_basis) == %du, \"entity_hash() differs from tools/gen_entities.py\");"
+          % entity_hash("amp", FNV_BASIS))
+    print()
+    print("static const struct entity {")
+    print("    const char* name;")
+    print("    const char* utf8;")
+    print("} s_entities[%d] = {" % len(names))
+    for name in names:
+        print("    {\"%s\", %s}," % (name, c_string(entities[name])))
+    print("};")
+    print()
+    print("static const uint16_t s_entity_displacements[%d] = {" % nbuckets)
+    for i in range(0, nbuckets, 12):
+        print("    " + " ".join("%d," % d for d in displacements[i:i+12]))
+    print("};")
+    print()
+    print("// Index into s_entities per slot, 0xffff if unused")
+    print("static const uint16_t s_entity_slot_index[%d] = {" % SLOTS)
+    for i in range(0, SLOTS, 12):
+        print("    " + " ".join("%d," % (index[n] if n is not None else 0xffff) for n in slots[i:i+12]))
+    print("};")
+
+main()
@@ -0,0 +1,763 @@
+/* Command-line HTML generator for the C++ POD parser.
+ *
+ * Copyright © 2019 Marvin Gülker
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Usage: pod2html [-o OUTDIR] [-j JOBS] [-f FORMAT] [-m FORMAT] [-c] [-n]
+ *                 [-g FILE] [-s FILE] [-q] [-U] INPUT...
+ *
+ * Converts POD documents to HTML pages. Each INPUT may be a file, a
+ * directory, which is searched recursively for *.pod files, or a
+ * glob pattern (quoted, so the shell leaves it alone). A file
+ * dir/Foo.pod found in an INPUT directory is written to
+ * OUTDIR/dir/Foo.html; the "Foo" part is what the naming scheme
+ * below calls the name of the document.
+ *
+ * -o OUTDIR  Output directory, default ".".
+ * -j JOBS    Number of files converted in parallel, default: number
+ *            of processors.
+ * -f FORMAT  Naming scheme of the HTML files, both of the written
+ *            ones and of the link targets of L<Foo>. "%n" is replaced
+ *            with the document or class/module name. Default "%n.html".
+ * -m FORMAT  Naming scheme of the anchors of methods, the target of
+ *            L<Foo#bar> and L<Foo::bar>. "%n" is replaced with the
+ *            method name, "%t" with "cm" for class/module methods and
+ *            "im" for instance methods. Default "%n-%t".
+ * -c         Check the targets of all L<> links, see below.
+ * -n         Don't write any HTML files, e.g. to only check the links.
+ * -g FILE    Write the links between the documents to FILE, one
+ *            line per document: its name, then the names of all
+ *            documents it links to, separated by tabs.
+ * -s FILE    Write a search index of all documents to FILE, to be
+ *            read with PodSearchIndexView. Its document names are
+ *            the names of the HTML files.
+ * -q         Don't report timings and unchanged files.
+ * -U         Don't use io_uring for reading and writing files.
+ *
+ * Files whose content would not change are not written again, so
+ * that their modification time stays the same.
+ *
+ * Each thread converts a few documents at a time. Their sources and
+ * current pages are read, and the changed pages written, together
+ * (see batch_io.hpp), while the next few documents are being opened.
+ *
+ * When checking links, a document can be referred to by its name as
+ * described above and by the name given in its NAME section, e.g.
+ * "Sprite" for "Sprite - The basic object". L<Foo/Bar> must name a
+ * heading or an X<> index entry of document Foo. L<Foo::bar> and
+ * L<Foo#bar> must name a heading below Foo's "CLASS METHODS" and
+ * "INSTANCE METHODS" headings, respectively; everything in the
+ * heading after the method name is ignored. Unresolved links are
+ * reported with their line and column, and make the exit status 1. */
+
+#include "../pod.hpp"
+#include "batch_io.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace Pod;
+
+struct document {
+    document(const std::string& p, const std::string& n) : path(p), name(n) {}
+
+    std::string path;   // Input file
+    std::string name;   // Relative path without .pod
+
+    // Collected while converting if links are checked
+    std::string title;  // Name given in the NAME section
+    std::unordered_set<std::string> sections; // Headings and X<> entries
+    std::unordered_set<std::string> cmethods;
+    std::unordered_set<std::string> imethods;
+    std::vector<PodLink> links;
+
+    // Collected while converting for the search index
+    std::unordered_map<std::string, unsigned int> terms;
+};
+
+struct settings {
+    std::string outdir;
+    bool check;  // Collect what is needed for checking links
+    bool write;  // Write the HTML pages
+    bool search; // Collect the words for the search index
+    bool quiet;
+    bool uring;  // Use io_uring if available
+};
+
+// Naming schemes; they are only set up before the workers start,
+// because the parser's callbacks are plain functions.
+static std::string s_file_format   = "%n.html";
+static std::string s_method_format = "%n-%t";
+
+static std::mutex s_output_mutex;
+
+// Text, data and verbatim payloads at least this long are written
+// from the parsed document rather than copied into the page first.
+// Shorter ones are cheaper to copy than to write separately.
+static const size_t s_fragment_threshold = 256;
+
+// Number of documents a thread converts at a time, at most
+static const size_t s_batch_size = 16;
+
+// Maps both names of each document to its index in the document list.
+static std::unordered_map<std::string, size_t> s_document_index;
+
+static std::string expand_format(const std::string& format, const std::string& name, const char* type)
+{
+    std::string result;
+    for (size_t i=0; i < format.length(); i++) {
+        if (format[i] == '%' && i+1 < format.length()) {
+            switch (format[i+1]) {
+            case 'n':
+                result += name;
+                i++;
+                continue;
+            case 't':
+                result += type;
+                i++;
+                continue;
+            case '%':
+                result += '%';
+                i++;
+                continue;
+            default:
+                break;
+            }
+        }
+        result += format[i];
+    }
+    return result;
+}
+
+static std::string filename_cb(std::string classmodname)
+{
+    return expand_format(s_file_format, classmodname, "");
+}
+
+static std::string methodname_cb(bool cmethod, std::string methodname)
+{
+    return expand_format(s_method_format, methodname, cmethod ? "cm" : "im");
+}
+
+static bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.length() >= suffix.length() && str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+static std::string strip_pod_extension(const std::string& path)
+{
+    return ends_with(path, ".pod") ? path.substr(0, path.length() - 4) : path;
+}
+
+static std::string basename_of(const std::string& path)
+{
+    size_t pos = path.rfind('/');
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// Adds all *.pod files below `dir' to `docs', named relative to `prefix'.
+static void find_documents(const std::string& dir, const std::string& prefix, std::vector<document>& docs)
+{
+    DIR* p_dir = opendir(dir.c_str());
+    if (!p_dir) {
+        std::cerr << "Cannot open directory '" << dir << "': " << strerror(errno) << std::endl;
+        return;
+    }
+
+    std::vector<std::string> entries;
+    while (struct dirent* p_entry = readdir(p_dir)) {
+        if (p_entry->d_name[0] != '.')
+            entries.push_back(p_entry->d_name);
+    }
+    closedir(p_dir);
+    std::sort(entries.begin(), entries.end());
+
+    for (const std::string& entry: entries) {
+        std::string path = dir + "/" + entry;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            continue;
+
+        if (S_ISDIR(info.st_mode))
+            find_documents(path, prefix + entry + "/", docs);
+        else if (S_ISREG(info.st_mode) && ends_with(entry, ".pod"))
+            docs.push_back(document{path, prefix + strip_pod_extension(entry)});
+    }
+}
+
+static bool add_input(const std::string& input, std::vector<document>& docs)
+{
+    struct stat info;
+    if (stat(input.c_str(), &info) == 0) {
+        if (S_ISDIR(info.st_mode))
+            find_documents(input, "", docs);
+        else
+            docs.push_back(document{input, strip_pod_extension(basename_of(input))});
+        return true;
+    }
+
+    glob_t matches;
+    if (glob(input.c_str(), 0, nullptr, &matches) != 0) {
+        std::cerr << "No such file, directory or match: '" << input << "'" << std::endl;
+        return false;
+    }
+    for (size_t i=0; i < matches.gl_pathc; i++) {
+        std::string path = matches.gl_pathv[i];
+        docs.push_back(document{path, strip_pod_extension(basename_of(path))});
+    }
+    globfree(&matches);
+    return true;
+}
+
+// Checks whether the concatenation of `fragments' is `content'.
+static bool same_content(const std::string& content, const std::vector<PodStringRef>& fragments)
+{
+    size_t pos = 0;
+    for (const PodStringRef& fragment: fragments) {
+        if (content.length() - pos < fragment.Size() || memcmp(content.data() + pos, fragment.Data(), fragment.Size()) != 0)
+            return false;
+        pos += fragment.Size();
+    }
+    return pos == content.length();
+}
+
+// Writes the concatenation of `fragments' to `path' unless the file
+// already has exactly that content. Returns false on error;
+// `written' tells whether the file was actually written.
+static bool write_if_changed(const std::string& path, const std::vector<PodStringRef>& fragments, bool& written)
+{
+    batch_io io(false);
+    std::vector<read_request> reads(1, read_request(path));
+    io.finish_reads(reads);
+    written = false;
+    if (reads[0].error == 0 && same_content(reads[0].content, fragments))
+        return true;
+
+    std::vector<write_request> writes(1, write_request(path, fragments));
+    io.write_files(writes);
+    errno = writes[0].error;
+    written = writes[0].error == 0;
+    return written;
+}
+
+static const char s_page_footer[] = "</body>\n</html>\n";
+
+// Everything of the page before the body.
+static std::string page_header(const PodParser& parser, const std::string& name)
+{
+    std::string title = parser.GetOutline().empty() ? name : parser.GetOutline()[0].text;
+    html_escape(title);
+
+    return "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>" + title + "</title>\n</head>\n<body>\n";
+}
+
+// Returns the text of the paragraph following the heading
+// `heading' up to the first " - ", or "" if there is none.
+static std::string name_section_title(const PodTokenStream& stream, const PodHeading& heading)
+{
+    size_t i = heading.last_token + 1;
+    if (i >= stream.Size() || stream.GetNtype(i) != ntype::para_start)
+        return "";
+
+    std::string text;
+    for (i++; i < stream.Size() && stream.GetNtype(i) != ntype::para_end; i++) {
+        if (stream.GetNtype(i) == ntype::text)
+            text += stream.GetPayload(i).ToString();
+    }
+
+    size_t pos = text.find(" - ");
+    if (pos == std::string::npos)
+        return "";
+    while (pos > 0 && text[pos-1] == ' ')
+        pos--;
+    return text.substr(0, pos);
+}
+
+// Records the link targets `doc' offers and the links it contains.
+static void collect_links(const PodParser& parser, document& doc)
+{
+    const std::vector<PodHeading>& outline = parser.GetOutline();
+    for (const PodHeading& heading: outline) {
+        doc.sections.insert(heading.text);
+
+        if (heading.text == "NAME" && doc.title.empty())
+            doc.title = name_section_title(parser.GetTokenStream(), heading);
+        if (heading.parent == std::string::npos)
+            continue;
+
+        const std::string& parent = outline[heading.parent].text;
+        std::string method = heading.text.substr(0, heading.text.find_first_of(" ("));
+        if (parent == "CLASS METHODS")
+            doc.cmethods.insert(method);
+        else if (parent == "INSTANCE METHODS")
+            doc.imethods.insert(method);
+    }
+    for (const auto& entry: parser.GetIndexEntries()) {
+        doc.sections.insert(entry.first);
+    }
+    doc.links = parser.GetLinks();
+}
+
+// Returns the index of the document named `name', or
+// std::string::npos if there is none.
+static size_t find_document(const std::string& name)
+{
+    auto iter = s_document_index.find(name);
+    return iter == s_document_index.end() ? std::string::npos : iter->second;
+}
+
+// Checks the links of docs[i]. Appends a message for each
+// unresolved one to `report' and the documents linked to to
+// `targets'. Returns the number of unresolved links.
+static size_t check_links(const std::vector<document>& docs, size_t i, std::string& report, std::set<std::string>& targets)
+{
+    const document& doc = docs[i];
+    size_t unresolved = 0;
+
+    for (const PodLink& link: doc.links) {
+        PodLinkTarget target = parse_link_target(link.target);
+        if (target.kind == LinkKind::url || target.kind == LinkKind::manpage)
+            continue;
+
+        std::string problem;
+        size_t linked = target.document.empty() ? i : find_document(target.document);
+        if (linked == std::string::npos) {
+            problem = "no document '" + target.document + "'";
+        }
+        else {
+            const document& other = docs[linked];
+            if (linked != i)
+                targets.insert(other.name);
+
+            switch (target.kind) {
+            case LinkKind::section:
+                if (!target.name.empty() && !other.sections.count(target.name))
+                    problem = "no section '" + target.name + "' in '" + other.name + "'";
+                break;
+            case LinkKind::class_method:
+                if (!other.cmethods.count(target.name))
+                    problem = "no class method '" + target.name + "' in '" + other.name + "'";
+                break;
+            case LinkKind::instance_method:
+                if (!other.imethods.count(target.name))
+                    problem = "no instance method '" + target.name + "' in '" + other.name + "'";
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (!problem.empty()) {
+            report += doc.path + ": Unresolved link on line " + std::to_string(link.line);
+            if (link.column > 0)
+                report += ", column " + std::to_string(link.column);
+            report += ": " + problem + "\n";
+            unresolved++;
+        }
+    }
+
+    return unresolved;
+}
+
+// Call with s_output_mutex locked.
+static void print_diagnostics(const document& doc, const PodParser& parser)
+{
+    for (const PodDiagnostic& diag: parser.GetDiagnostics()) {
+        std::cerr << doc.path << ": " << format_diagnostic(diag) << std::endl;
+    }
+}
+
+// Calls `fn' with every index below `count', using `jobs' threads.
+// Each thread takes the next index until none is left.
+template<typename Function>
+static void run_parallel(size_t count, unsigned int jobs, Function fn)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < count) {
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int n=1; n < jobs && n < count; n++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread& thread: threads) {
+        thread.join();
+    }
+}
+
+// A document of a batch while it is converted, see convert_batch().
+struct conversion {
+    std::unique_ptr<PodParser> p_parser;
+    std::unique_ptr<PodHTMLRenderer> p_html;
+    std::string header; // The page is `header', the HTML and s_page_footer
+    std::vector<PodStringRef> page;
+    double parse_ms;
+    double render_ms;
+    bool written;
+};
+
+// Parses and renders `doc' from `source'. The page refers to the
+// parser and renderer in `conv', so it must be kept until the page
+// is written.
+static void convert(document& doc, const settings& opts, const std::string& source, conversion& conv)
+{
+    typedef std::chrono::steady_clock clock;
+
+    clock::time_point start = clock::now();
+    conv.p_parser.reset(new PodParser(source, filename_cb, methodname_cb));
+    PodParser& parser = *conv.p_parser;
+    parser.Parse();
+    if (opts.check)
+        collect_links(parser, doc);
+    clock::time_point parsed = clock::now();
+
+    // The page and the words for the search index in one pass. Large
+    // payloads are written from the source instead of being copied.
+    conv.p_html.reset(new PodHTMLRenderer(filename_cb, methodname_cb));
+    PodHTMLRenderer& html = *conv.p_html;
+    html.SetFragmentThreshold(s_fragment_threshold);
+    PodTermRenderer terms;
+    if (opts.write || opts.search) {
+        PodFanOutRenderer<PodHTMLRenderer, PodTermRenderer> renderer(opts.write ? &html : nullptr, opts.search ? &terms : nullptr);
+        renderer.Render(parser.GetTokenStream());
+        doc.terms = terms.GetTerms();
+    }
+
+    if (opts.write) {
+        conv.header = page_header(parser, doc.name);
+        conv.page = html.GetFragments();
+        conv.page.insert(conv.page.begin(), conv.header);
+        conv.page.push_back(PodStringRef(s_page_footer, sizeof(s_page_footer) - 1));
+    }
+    clock::time_point rendered = clock::now();
+
+    conv.parse_ms  = std::chrono::duration<double, std::milli>(parsed - start).count();
+    conv.render_ms = std::chrono::duration<double, std::milli>(rendered - parsed).count();
+}
+
+static std::string output_path(const document& doc, const settings& opts)
+{
+    return opts.outdir + "/" + filename_cb(doc.name);
+}
+
+// The files to read for docs[first] up to docs[last]: the source of
+// each, followed by its current page if pages are written.
+static std::vector<read_request> batch_reads(const std::vector<document>& docs, size_t first, size_t last, const settings& opts)
+{
+    std::vector<read_request> reads;
+    for (size_t i=first; i < last; i++) {
+        reads.push_back(read_request(docs[i].path));
+        if (opts.write)
+            reads.push_back(read_request(output_path(docs[i], opts)));
+    }
+    return reads;
+}
+
+// Converts docs[first] up to docs[last], whose files are being read
+// with `reads' (see batch_reads()). Returns false on failure.
+static bool convert_batch(batch_io& io, std::vector<document>& docs, size_t first, size_t last,
+                          std::vector<read_request>& reads, const settings& opts)
+{
+    io.finish_reads(reads);
+
+    size_t per_doc = opts.write ? 2 : 1;
+    std::vector<conversion> conversions(last - first);
+    std::vector<write_request> writes;
+    std::vector<size_t> written_docs;
+    for (size_t i=first; i < last; i++) {
+        const read_request& source = reads[(i - first) * per_doc];
+        conversion& conv = conversions[i - first];
+        conv.written = false;
+        if (source.error != 0)
+            continue;
+
+        convert(docs[i], opts, source.content, conv);
+        if (!opts.write)
+            continue;
+
+        const read_request& old_page = reads[(i - first) * per_doc + 1];
+        if (old_page.error != 0 || !same_content(old_page.content, conv.page)) {
+            writes.push_back(write_request(output_path(docs[i], opts), conv.page));
+            written_docs.push_back(i);
+            conv.written = true;
+        }
+    }
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    io.write_files(writes);
+    double write_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+    bool ok = true;
+    size_t failed = 0;
+    std::lock_guard<std::mutex> lock(s_output_mutex);
+    for (size_t i=first; i < last; i++) {
+        const read_request& source = reads[(i - first) * per_doc];
+        const conversion& conv = conversions[i - first];
+        if (source.error != 0) {
+            std::cerr << "Cannot read '" << docs[i].path << "': " << strerror(source.error) << std::endl;
+            ok = false;
+            continue;
+        }
+
+        print_diagnostics(docs[i], *conv.p_parser);
+        if (!opts.write)
+            continue;
+
+        std::string outpath = output_path(docs[i], opts);
+        if (conv.written) {
+            size_t w = std::find(written_docs.begin(), written_docs.end(), i) - written_docs.begin();
+            if (writes[w].error != 0) {
+                std::cerr << "Cannot write '" << outpath << "': " << strerror(writes[w].error) << std::endl;
+                failed++;
+                ok = false;
+                continue;
+            }
+        }
+        if (!opts.quiet || conv.written) {
+            printf("%-40s %s  parse %8.3f ms  render %8.3f ms\n",
+                   outpath.c_str(), conv.written ? "written  " : "unchanged", conv.parse_ms, conv.render_ms);
+        }
+    }
+    if (writes.size() > failed && !opts.quiet)
+        printf("%zu page(s) written in %.3f ms\n", writes.size() - failed, write_ms);
+
+    return ok;
+}
+
+// Converts all of `docs' with `jobs' threads, each taking the next
+// batch of documents when done with one. The files of that batch are
+// already being opened while the current one is converted, so a
+// thread holds two batches at a time; batches are made smaller than
+// s_batch_size if that is needed to give every thread some.
+// `workers' is set to the number of threads that converted anything.
+static bool convert_all(std::vector<document>& docs, const settings& opts, unsigned int jobs, unsigned int& workers)
+{
+    size_t batch_size = std::max<size_t>(1, std::min(s_batch_size, docs.size() / (2 * jobs)));
+    size_t batches = (docs.size() + batch_size - 1) / batch_size;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> all_converted(true);
+    std::atomic<unsigned int> active(0);
+
+    run_parallel(jobs, jobs, [&](size_t) {
+        batch_io io(opts.uring);
+        size_t batch = next++;
+        if (batch >= batches)
+            return;
+        active++;
+
+        std::vector<read_request> reads = batch_reads(docs, batch * batch_size, std::min(docs.size(), (batch + 1) * batch_size), opts);
+        io.start_reads(reads);
+        while (batch < batches) {
+            size_t following = next++;
+            std::vector<read_request> following_reads;
+            if (following < batches) {
+                following_reads = batch_reads(docs, following * batch_size, std::min(docs.size(), (following + 1) * batch_size), opts);
+                io.start_reads(following_reads);
+            }
+
+            if (!convert_batch(io, docs, batch * batch_size, std::min(docs.size(), (batch + 1) * batch_size), reads, opts))
+                all_converted = false;
+
+            batch = following;
+            reads.swap(following_reads);
+        }
+    });
+
+    workers = active;
+    return all_converted;
+}
+
+static void usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [-o OUTDIR] [-j JOBS] [-f FORMAT] [-m FORMAT] [-c] [-n] [-g FILE] [-s FILE] [-q] [-U] INPUT..." << std::endl;
+}
+
+static bool write_graph(const std::string& path, const std::vector<document>& docs, const std::vector<std::set<std::string>>& targets)
+{
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    for (size_t i=0; i < docs.size(); i++) {
+        file << docs[i].name;
+        for (const std::string& target: targets[i]) {
+            file << '\t' << target;
+        }
+        file << '\n';
+    }
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char* argv[])
+{
+    typedef std::chrono::steady_clock clock;
+
+    settings opts = {".", false, true, false, false, true};
+    std::string graphpath;
+    std::string searchpath;
+    unsigned int jobs = std::thread::hardware_concurrency();
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:j:f:m:cng:s:qUh")) != -1) {
+        switch (opt) {
+        case 'o':
+            opts.outdir = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'f':
+            s_file_format = optarg;
+            break;
+        case 'm':
+            s_method_format = optarg;
+            break;
+        case 'c':
+            opts.check = true;
+            break;
+        case 'n':
+            opts.write = false;
+            break;
+        case 'g':
+            opts.check = true;
+            graphpath = optarg;
+            break;
+        case 's':
+            opts.search = true;
+            searchpath = optarg;
+            break;
+        case 'q':
+            opts.quiet = true;
+            break;
+        case 'U':
+            opts.uring = false;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (jobs == 0)
+        jobs = 1;
+
+    bool ok = true;
+    std::vector<document> docs;
+    for (int i=optind; i < argc; i++) {
+        ok = add_input(argv[i], docs) && ok;
+    }
+
+    clock::time_point start = clock::now();
+    unsigned int workers = 0;
+    ok = convert_all(docs, opts, jobs, workers) && ok;
+
+    if (!opts.quiet) {
+        printf("%zu file(s) in %.3f ms with %u job(s) using %s\n", docs.size(),
+               std::chrono::duration<double, std::milli>(clock::now() - start).count(),
+               workers,
+               batch_io(opts.uring).uses_uring() ? "io_uring" : "read/write");
+    }
+
+    if (opts.search) {
+        start = clock::now();
+        PodSearchIndexBuilder builder;
+        for (const document& doc: docs) {
+            builder.AddDocument(filename_cb(doc.name), doc.terms);
+        }
+
+        std::string index = builder.Serialize();
+        bool written = false;
+        if (!write_if_changed(searchpath, std::vector<PodStringRef>(1, index), written)) {
+            std::cerr << "Cannot write '" << searchpath << "': " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        else if (!opts.quiet || written) {
+            printf("%-40s %s  index %8.3f ms\n", searchpath.c_str(), written ? "written  " : "unchanged",
+                   std::chrono::duration<double, std::milli>(clock::now() - start).count());
+        }
+    }
+    if (!opts.check)
+        return ok ? 0 : 1;
+
+    // All documents are known now, so the links can be checked.
+    // The index is only read while checking.
+    start = clock::now();
+    for (size_t i=0; i < docs.size(); i++) {
+        s_document_index.insert(std::make_pair(docs[i].name, i)); // First one wins
+        if (!docs[i].title.empty())
+            s_document_index.insert(std::make_pair(docs[i].title, i));
+    }
+
+    std::vector<std::string> reports(docs.size());
+    std::vector<std::set<std::string>> targets(docs.size());
+    std::atomic<size_t> unresolved(0);
+    run_parallel(docs.size(), jobs, [&](size_t i) {
+        unresolved += check_links(docs, i, reports[i], targets[i]);
+    });
+
+    size_t links = 0;
+    for (size_t i=0; i < docs.size(); i++) {
+        std::cerr << reports[i];
+        links += docs[i].links.size();
+    }
+    if (!graphpath.empty() && !write_graph(graphpath, docs, targets)) {
+        std::cerr << "Cannot write '" << graphpath << "': " << strerror(errno) << std::endl;
+        ok = false;
+    }
+    if (!opts.quiet) {
+        printf("%zu link(s) checked in %.3f ms, %zu unresolved\n", links,
+               std::chrono::duration<double, std::milli>(clock::now() - start).count(),
+               unresolved.load());
+    }
+
+    return ok && unresolved == 0 ? 0 : 1;
+}